@@ -2,20 +2,32 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <cstdio>
 
 #include <algorithm>
 #include <vector>
 #include <deque>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <string>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <atomic>
 
 #include <loginc.h>
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+/* sockaddr_un arrived with the Windows 10 (1803) SDK; older SDKs, like the v110 toolset's, build without AF_UNIX support */
+#if defined(NTDDI_WIN10_RS4)
+#include <afunix.h>
+#define NET_HAVE_AF_UNIX
+#endif
+#include <intrin.h>
+#include <nmmintrin.h>
 
 #include <NetStuff.h>
 
@@ -25,7 +37,50 @@
 #define MEHTHROW(s) (::std::runtime_error((s ## " " ## __FILE__ ## " ") + ::std::to_string(__LINE__)))
 
 #define MAGIC_READ_SIZE 1024
+#define READ_SIZE_MIN 256
+#define READ_SIZE_MAX (4 * 1024 * 1024)
+#define ACCEPT_BATCH_MAX 128
+#define LISTEN_PORT_DEFAULT "27010"
 #define PACKET_PART_SIZE_LEN 4
+#define COALESCE_FRAG_THRESHOLD 8
+#define COALESCE_FRAG_SMALL 512
+#define COALESCE_BLOCK_MAX (64 * 1024)
+#define BUF_POOL_SLAB_MAX 16
+#define SHM_MAGIC 0x4e534d31
+#define HANDOFF_HELLO 1
+#define HANDOFF_SOCK 2
+#define HANDOFF_ACK 3
+#define DGRAM_SIZE_MAX (64 * 1024)
+#define DGRAM_BATCH_MAX 64
+#define DGRAM_OFFLOAD_BYTES_MAX 65000
+#define HOT_RESTART_MAGIC 0x4e534852
+#define HASH_RING_VNODES 64
+#define RELAY_BUF_SIZE (64 * 1024)
+#define WRITE_IOV_MAX 64
+#define RPC_HDR_LEN 5
+#define RPC_KIND_REQUEST 'Q'
+#define RPC_KIND_REPLY 'R'
+#define RPC_SLOTS_MAX 65536
+#define MUX_HDR_LEN 5
+#define MUX_KIND_DATA 'D'
+#define MUX_KIND_WINDOW 'W'
+#define MUX_KIND_CLOSE 'C'
+#define MUX_STREAMS_MAX 256
+#define MUX_WINDOW_DEFAULT (256 * 1024)
+#define MUX_FRAME_MAX (16 * 1024)
+#define FLAT_HDR_LEN 4
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_COPY_BLOCK 4096
+#define COMPRESS_HDR_LEN 5
+#define COMPRESS_KIND_HELLO 'H'
+#define COMPRESS_KIND_STORED 'S'
+#define COMPRESS_KIND_LZ4 'L'
+#define COMPRESS_BLOCK_MAX READ_SIZE_MAX
+#define COMPRESS_MIN_DEFAULT 128
+#define COMPRESS_SKIP 32
+#define COMPRESS_HASH_LOG 12
+#define COMPRESS_WINDOW 65535
+#define STAGE_FUSE_BLOCK 4096
 
 /* template<typename T> void PtrCond(T *p, T v) { if (p) *p = v; } */
 #define PTR_COND(p,v) do { auto _f_ = (p); if (_f_) { *_f_ = (v); } } while(0)
@@ -63,14 +118,252 @@ namespace NetData {
         return str;
     }
 
-    Fragment::Fragment(const Stamp &stamp, const string &data) : stamp(stamp), data(data) {}
+    static const size_t GBufClassSize[BufPool::NumClasses] = { 256, 4 * 1024, 64 * 1024 };
+    static const uint32_t GBufTlsMax[BufPool::NumClasses] = { 64, 16, 4 };
 
-    string Fragment::SplitFragPrefix(size_t partNo) const {
+    struct BufFree {
+        BufFree *next;
+    };
+
+    /* POD for __declspec(thread), a thread's cache is not drained when it exits */
+    struct BufPoolTls {
+        BufFree *head[BufPool::NumClasses];
+        uint32_t count[BufPool::NumClasses];
+    };
+
+    struct BufPoolShared {
+        mutex mtx;
+        BufFree *head[BufPool::NumClasses];
+        size_t count[BufPool::NumClasses];
+        vector<pair<char *, size_t> > slabs; /* Large page backed, kept for the process lifetime */
+        bool hugePages;
+
+        BufPoolShared() : hugePages(false) {
+            for (size_t c = 0; c < BufPool::NumClasses; c++) { head[c] = nullptr; count[c] = 0; }
+        }
+
+        bool InSlab(const void *p) const {
+            for (auto &i : slabs)
+                if ((const char *)p >= i.first && (const char *)p < i.first + i.second) return true;
+            return false;
+        }
+
+        /* Carve one large page allocation into blocks of class c. Needs SeLockMemoryPrivilege, turns itself off if refused. */
+        void SlabRefill(size_t c) {
+            const size_t lp = GetLargePageMinimum();
+            if (!lp || slabs.size() >= BUF_POOL_SLAB_MAX) return;
+
+            const size_t sz = ((ZZMAX(lp, GBufClassSize[c]) + lp - 1) / lp) * lp;
+            char *slab = (char *)VirtualAlloc(nullptr, sz, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (!slab) {
+                LOG(WARNING) << "Large page allocation refused, BufPool falls back to the heap";
+                hugePages = false;
+                return;
+            }
+
+            slabs.push_back(make_pair(slab, sz));
+
+            for (size_t off = 0; off + GBufClassSize[c] <= sz; off += GBufClassSize[c]) {
+                BufFree *b = (BufFree *)(slab + off);
+                b->next = head[c];
+                head[c] = b;
+                count[c]++;
+            }
+        }
+    };
+
+    static BufPoolShared GBufShared;
+    static __declspec(thread) BufPoolTls GBufTls;
+
+    size_t BufPool::ClassOf(size_t n) {
+        for (size_t c = 0; c < NumClasses; c++)
+            if (n <= GBufClassSize[c]) return c;
+        return NumClasses;
+    }
+
+    size_t BufPool::ClassSize(size_t c) {
+        return GBufClassSize[c];
+    }
+
+    void * BufPool::Alloc(size_t n) {
+        const size_t c = ClassOf(n);
+        if (c == NumClasses) return ::operator new(n);
+
+        BufPoolTls &t = GBufTls;
+
+        if (!t.head[c]) {
+            lock_guard<mutex> lock(GBufShared.mtx);
+
+            if (!GBufShared.head[c] && GBufShared.hugePages && c == NumClasses - 1)
+                GBufShared.SlabRefill(c);
+
+            /* Half a cache worth, so the next few allocations stay lock-free */
+            for (uint32_t i = 0; i < GBufTlsMax[c] / 2 && GBufShared.head[c]; i++) {
+                BufFree *b = GBufShared.head[c];
+                GBufShared.head[c] = b->next;
+                GBufShared.count[c]--;
+                b->next = t.head[c];
+                t.head[c] = b;
+                t.count[c]++;
+            }
+        }
+
+        if (!t.head[c]) return ::operator new(GBufClassSize[c]);
+
+        BufFree *b = t.head[c];
+        t.head[c] = b->next;
+        t.count[c]--;
+        return b;
+    }
+
+    void BufPool::Free(void *p, size_t n) {
+        if (!p) return;
+
+        const size_t c = ClassOf(n);
+        if (c == NumClasses) { ::operator delete(p); return; }
+
+        BufPoolTls &t = GBufTls;
+
+        BufFree *b = (BufFree *)p;
+        b->next = t.head[c];
+        t.head[c] = b;
+        t.count[c]++;
+
+        if (t.count[c] > GBufTlsMax[c]) {
+            lock_guard<mutex> lock(GBufShared.mtx);
+
+            while (t.count[c] > GBufTlsMax[c] / 2) {
+                BufFree *w = t.head[c];
+                t.head[c] = w->next;
+                t.count[c]--;
+                w->next = GBufShared.head[c];
+                GBufShared.head[c] = w;
+                GBufShared.count[c]++;
+            }
+        }
+    }
+
+    /* Returns the calling thread's cache and the shared free lists to the system (large page slabs excepted) */
+    void BufPool::Trim() {
+        BufPoolTls &t = GBufTls;
+        lock_guard<mutex> lock(GBufShared.mtx);
+
+        for (size_t c = 0; c < NumClasses; c++) {
+            while (t.head[c]) {
+                BufFree *w = t.head[c];
+                t.head[c] = w->next;
+                w->next = GBufShared.head[c];
+                GBufShared.head[c] = w;
+                GBufShared.count[c]++;
+            }
+            t.count[c] = 0;
+
+            BufFree *keep = nullptr;
+            size_t kept = 0;
+
+            while (GBufShared.head[c]) {
+                BufFree *w = GBufShared.head[c];
+                GBufShared.head[c] = w->next;
+                if (GBufShared.InSlab(w)) { w->next = keep; keep = w; kept++; }
+                else                      ::operator delete(w);
+            }
+
+            GBufShared.head[c] = keep;
+            GBufShared.count[c] = kept;
+        }
+    }
+
+    /* Bytes sitting in the shared lists and the calling thread's cache */
+    size_t BufPool::Cached() {
+        BufPoolTls &t = GBufTls;
+        lock_guard<mutex> lock(GBufShared.mtx);
+        size_t n = 0;
+
+        for (size_t c = 0; c < NumClasses; c++)
+            n += (GBufShared.count[c] + t.count[c]) * GBufClassSize[c];
+
+        return n;
+    }
+
+    void BufPool::UseHugePages(bool use) {
+        lock_guard<mutex> lock(GBufShared.mtx);
+        GBufShared.hugePages = use;
+    }
+
+    namespace Crc32c {
+
+        static bool CpuHasSse42() {
+            int r[4];
+            __cpuid(r, 1);
+            return (r[2] & (1 << 20)) != 0;
+        }
+
+        static const bool GHw = CpuHasSse42();
+
+        static const struct Table {
+            uint32_t t[256];
+            Table() {
+                for (uint32_t i = 0; i < 256; i++) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+                    t[i] = c;
+                }
+            }
+        } GTable;
+
+        static uint32_t UpdateHw(uint32_t c, const unsigned char *p, size_t n) {
+            for (; n && ((uintptr_t)p & 7); n--) c = _mm_crc32_u8(c, *p++);
+#if defined(_M_X64)
+            uint64_t c64 = c;
+            for (; n >= 8; n -= 8, p += 8) { uint64_t v; memcpy(&v, p, 8); c64 = _mm_crc32_u64(c64, v); }
+            c = (uint32_t)c64;
+#endif
+            for (; n >= 4; n -= 4, p += 4) { uint32_t v; memcpy(&v, p, 4); c = _mm_crc32_u32(c, v); }
+            for (; n; n--) c = _mm_crc32_u8(c, *p++);
+            return c;
+        }
+
+        uint32_t Update(uint32_t crc, const char *p, size_t n) {
+            const unsigned char *q = (const unsigned char *)p;
+            uint32_t c = ~crc;
+
+            if (GHw) c = UpdateHw(c, q, n);
+            else     for (; n; n--) c = GTable.t[(c ^ *q++) & 0xff] ^ (c >> 8);
+
+            return ~c;
+        }
+
+        bool HardwareP() {
+            return GHw;
+        }
+
+        /* Copy and checksum block by block, the source comes from memory once: each block is checksummed, then appended while still in L1 */
+        template<typename T>
+        static uint32_t Append(uint32_t crc, T *out, const char *p, size_t n) {
+            while (n) {
+                const size_t k = ZZMIN(n, (size_t)CRC32C_COPY_BLOCK);
+                crc = Update(crc, p, k);
+                out->append(p, k);
+                p += k;
+                n -= k;
+            }
+            return crc;
+        }
+
+    };
+
+    Fragment::Fragment(const Stamp &stamp, const string &data) : stamp(stamp), data(data.data(), data.size()) {}
+
+    Fragment::Fragment(const Stamp &stamp, const char *data) : stamp(stamp), data(data) {}
+
+    Fragment::Fragment(const Stamp &stamp, Buf &&data) : stamp(stamp), data(move(data)) {}
+
+    Buf Fragment::SplitFragPrefix(size_t partNo) const {
         return data.substr(0, partNo);
     }
 
-    string Fragment::SplitFragSuffix(size_t partNo) const {
-        return data.substr(partNo, string::npos);
+    Buf Fragment::SplitFragSuffix(size_t partNo) const {
+        return data.substr(partNo, Buf::npos);
     }
 
     void Fragment::ErasePrefixTo(deque<Fragment> *deq, const PackCont &pc) {
@@ -93,6 +386,39 @@ namespace NetData {
         copy(deq.begin() + (pc.fragNo + 1), deq.end(), back_inserter(*out));
     }
 
+    /* Runs of fragments under smallMax are appended into one block (up to blockMax), large fragments are moved as-is.
+       The stamp of a block is the stamp of its first fragment. */
+    void Fragment::CoalesceSmall(deque<Fragment> *deq, size_t smallMax, size_t blockMax) {
+        /* Most reads have nothing to merge, those leave the deque untouched */
+        size_t k = 1;
+        for (; k < deq->size(); k++) {
+            const Buf &a = (*deq)[k - 1].data, &b = (*deq)[k].data;
+            if (a.size() < smallMax && b.size() < smallMax && a.size() + b.size() <= blockMax) break;
+        }
+        if (k >= deq->size()) return;
+
+        /* Compacts in place from there, w is the last fragment kept, open while it takes more */
+        size_t w = k - 1;
+        bool open = true;
+
+        for (size_t i = k; i < deq->size(); i++) {
+            Fragment &f = (*deq)[i];
+            const bool small = f.data.size() < smallMax;
+
+            if (small && open && (*deq)[w].data.size() + f.data.size() <= blockMax) {
+                (*deq)[w].data.append(f.data);
+            } else {
+                if (++w != i) {
+                    (*deq)[w].stamp = f.stamp;
+                    (*deq)[w].data.swap(f.data);
+                }
+                open = small;
+            }
+        }
+
+        deq->erase(deq->begin() + w + 1, deq->end());
+    }
+
     PackCont::PackCont() : fragNo(0), partNo(0) {}
 
     PackCont::PackCont(size_t fragNo, size_t partNo) : fragNo(fragNo), partNo(partNo) {}
@@ -110,10 +436,46 @@ namespace NetNative {
 
     PollFdType::PollFdType(SOCKET s) : s(s) {}
 
-    PrimitiveListening::PrimitiveListening() : pfd(GNetNat.MakePollFdType(INVALID_SOCKET)) {
+    ListenSpec::ListenSpec() : addr(), port(LISTEN_PORT_DEFAULT), family(AF_INET), dualStack(false), backlog(SOMAXCONN), deferAccept(0), fastOpen(0) {}
+
+    ListenSpec::ListenSpec(const string &port) : addr(), port(port), family(AF_INET), dualStack(false), backlog(SOMAXCONN), deferAccept(0), fastOpen(0) {}
+
+    ListenSpec::ListenSpec(const string &addr, const string &port, int family) : addr(addr), port(port), family(family), dualStack(family == AF_INET6), backlog(SOMAXCONN), deferAccept(0), fastOpen(0) {}
+
+    ListenSpec ListenSpec::Unix(const string &path) {
+        ListenSpec ret;
+        ret.port.clear();
+        ret.family = AF_UNIX;
+        ret.path = path;
+        return ret;
+    }
+
+    PrimitiveListening::PrimitiveListening() : nextListener(0), pfds(), acceptBatchMax(ACCEPT_BATCH_MAX) {
+        pfds.push_back(GNetNat.MakePollFdType(Listen(ListenSpec())));
+        families.push_back(AF_INET);
+    }
+
+    PrimitiveListening::PrimitiveListening(const vector<ListenSpec> &specs) : nextListener(0), pfds(), acceptBatchMax(ACCEPT_BATCH_MAX) {
+        try {
+            for (auto &i : specs) {
+                pfds.push_back(GNetNat.MakePollFdType(i.family == AF_UNIX ? ListenUnix(i) : Listen(i)));
+                families.push_back(i.family);
+            }
+        } catch (exception &) {
+            for (auto &i : pfds) closesocket(i.s);
+            throw;
+        }
+    }
+
+    PrimitiveListening::~PrimitiveListening()
+    {
+        for (auto &i : pfds) closesocket(i.s);
+    }
+
+    SOCKET PrimitiveListening::Listen(const ListenSpec &spec) {
         struct addrinfo *res = nullptr;
         struct addrinfo hints = {0};
-        hints.ai_family = AF_INET;
+        hints.ai_family = spec.family;
         hints.ai_socktype = SOCK_STREAM;
         hints.ai_protocol = 0;
         hints.ai_flags = AI_PASSIVE;
@@ -122,511 +484,3398 @@ namespace NetNative {
 
         try {
 
-            if (getaddrinfo(nullptr, "27010", &hints, &res))
+            if (getaddrinfo(spec.addr.empty() ? nullptr : spec.addr.c_str(), spec.port.c_str(), &hints, &res))
                 throw exception("Getaddrinfo");
 
             if ((listen_sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == INVALID_SOCKET)
                 throw exception("Socket creation");
 
+            if (res->ai_family == AF_INET6) {
+                int v6only = !spec.dualStack;
+                if (setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof v6only) == SOCKET_ERROR)
+                    throw exception("Socket dual stack mode");
+            }
+
             if (bind(listen_sock, res->ai_addr, res->ai_addrlen) == SOCKET_ERROR)
                 throw exception("Socket bind");
 
-            if (listen(listen_sock, SOMAXCONN) == SOCKET_ERROR)
+            /* Optional, a platform lacking TFO / deferred accept still gets a working listener */
+            if (spec.fastOpen && !GNetNat.SetupFastOpen(listen_sock, spec.fastOpen))
+                LOG(WARNING) << "TCP_FASTOPEN unavailable on " << spec.port;
+
+            if (listen(listen_sock, spec.backlog) == SOCKET_ERROR)
                 throw exception("Socket listen");
 
+            if (spec.deferAccept && !GNetNat.SetupDeferAccept(listen_sock, spec.deferAccept))
+                LOG(WARNING) << "TCP_DEFER_ACCEPT unavailable on " << spec.port;
+
             u_long blockmode = 1;
             if (ioctlsocket(listen_sock, FIONBIO, &blockmode) != NO_ERROR)
                 throw exception("Socket nonblocking mode");
 
             freeaddrinfo(res);
 
-            pfd = GNetNat.MakePollFdType(listen_sock);
-
         } catch (exception &) {
             if (res) freeaddrinfo(res);
             if (listen_sock != INVALID_SOCKET) closesocket(listen_sock);
             throw;
         }
+
+        return listen_sock;
     }
 
-    PrimitiveListening::~PrimitiveListening()
-    {
-        closesocket(pfd.s);
+#if defined(NET_HAVE_AF_UNIX)
+    static bool MakeUnixAddr(const string &path, sockaddr_un *sa) {
+        memset(sa, 0, sizeof *sa);
+        sa->sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof sa->sun_path) return false;
+        memcpy(sa->sun_path, path.c_str(), path.size());
+        return true;
     }
 
-    vector<PollFdType> PrimitiveListening::Accept() const
-    {
-        vector<PollFdType> ret;
+    /* Removes the file at the path only if it is a socket (a reparse point) nobody accepts on any more */
+    static void RemoveStaleUnix(const string &path, const sockaddr_un &sa) {
+        const DWORD attr = GetFileAttributesA(path.c_str());
+        if (attr == INVALID_FILE_ATTRIBUTES) return;
 
-        try {
-            for (;;) {
-                SOCKET s = accept(pfd.s, nullptr, nullptr);
-                if (s != INVALID_SOCKET) ret.push_back(GNetNat.MakePollFdType(SOCKET(s)));
-                if (s == INVALID_SOCKET)
-                    if (GNetNat.ErrorWouldBlock()) throw NetData::NetBlockExc();
-                    else						   throw NetData::NetFailureExc();
-            }
-        } catch (NetData::NetBlockExc &e) {}
+        if (!(attr & FILE_ATTRIBUTE_REPARSE_POINT))
+            throw exception("Socket path is not a socket");
 
-        return ret;
-    }
+        SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET)
+            throw exception("Socket creation");
 
-    bool NetFuncs::ErrorWouldBlock() {
-        int e = WSAGetLastError();
-        return e == WSAEWOULDBLOCK || e == WSAEINTR || e == WSAEINPROGRESS;
-    }
+        const bool live = connect(s, (const sockaddr *)&sa, sizeof sa) != SOCKET_ERROR;
+        closesocket(s);
 
-    void NetFuncs::PollFdTypeRead(const PollFdType &pfd, deque<NetData::Fragment>* w) {
-        char buf[MAGIC_READ_SIZE];
+        if (live)
+            throw exception("Socket path in use");
 
-        for (;;) {
-            int r = recv(pfd.s, buf, MAGIC_READ_SIZE, 0);
-            if (r == 0)                throw NetData::NetDisconnectExc();
-            if (r == SOCKET_ERROR)
-                if (ErrorWouldBlock()) throw NetData::NetBlockExc();
-                else                   throw NetFailureErrExc();
+        remove(path.c_str());
+    }
+#endif
 
-                /* FIXME: EmptyStamp */
-                w->push_back(NetData::Fragment(NetData::EmptyStamp(), string(buf, r)));
-        }
-    };
+    /* A stale socket file from a previous run would fail the bind, it is removed first */
+    SOCKET PrimitiveListening::ListenUnix(const ListenSpec &spec) {
+#if defined(NET_HAVE_AF_UNIX)
+        sockaddr_un sa;
+        SOCKET listen_sock = INVALID_SOCKET;
 
-    PollFdType NetFuncs::MakePollFdType(SOCKET s) {
-        return PollFdType(s);
-    }
+        try {
 
-    void MessSockSlave::ReadyForPoll() {
-        for (size_t i = 0; i < pfds.size(); i++) {
-            pfds[i].events = POLLIN | POLLOUT;
-            pfds[i].revents = 0;
-        }
-    };
+            if (!MakeUnixAddr(spec.path, &sa))
+                throw exception("Socket path");
 
-    vector<bool> MessSockSlave::PerformPoll() {
-        vector<bool> ret;
+            if ((listen_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+                throw exception("Socket creation");
 
-        int r = WSAPoll(pfds.data(), pfds.size(), 0);
-        if (r == SOCKET_ERROR) 
-            throw NetFailureErrExc();
+            RemoveStaleUnix(spec.path, sa);
 
-        for (size_t i = 0; i < pfds.size(); i++) {
-            if (pfds[i].revents & (POLLIN | POLLOUT)) ret.push_back(1);
-            else ret.push_back(0);
-        }
+            if (bind(listen_sock, (const sockaddr *)&sa, sizeof sa) == SOCKET_ERROR)
+                throw exception("Socket bind");
 
-        return ret;
-    }
+            if (listen(listen_sock, spec.backlog) == SOCKET_ERROR)
+                throw exception("Socket listen");
 
-    void MessSockSlave::RebuildPollFrom(const vector<PollFdType> &p) {
-        pfds.resize(p.size());
+            u_long blockmode = 1;
+            if (ioctlsocket(listen_sock, FIONBIO, &blockmode) != NO_ERROR)
+                throw exception("Socket nonblocking mode");
 
-        for (size_t i = 0; i < p.size(); i++) {
-            /* FIXME: Some kind of PollFdType::ExtractInto */
-            pfds[i].fd = p[i].s;
+        } catch (exception &) {
+            if (listen_sock != INVALID_SOCKET) closesocket(listen_sock);
+            throw;
         }
 
-        ReadyForPoll();
+        return listen_sock;
+#else
+        throw exception("AF_UNIX not supported by this SDK");
+#endif
     }
 
-};
+    vector<PollFdType> PrimitiveListening::Accept() const
+    {
+        vector<PollFdType> ret;
+        AcceptBatch(&ret, acceptBatchMax);
+        return ret;
+    }
 
-namespace NetStuff {
+    /* Drains at most maxN pending connections, the rest stay in the backlog until the next tick.
+       The cap is shared by all listeners, the first one drained rotates each call so a busy port can't starve the others.
+       Accepted sockets inherit non-blocking mode from the listening socket (Winsock has no accept4,
+       inheritance gets us SOCK_NONBLOCK for free), the remaining setup is done by SetupAccepted. */
+    size_t PrimitiveListening::AcceptBatch(vector<PollFdType> *out, size_t maxN) const
+    {
+        size_t n = 0;
 
-    PrimitiveMemonly::PrimitiveMemonly(const char **strs) {
-        for (size_t i = 0; strs[i] != nullptr; i++)
-            read.push_back(Fragment(EmptyStamp(), string(strs[i])));
-    }
+        if (pfds.empty()) return 0;
 
-    vector<PrimitiveMemonly> PrimitiveMemonly::MakePrims(const char **strs) {
-        vector<PrimitiveMemonly> ret;
-        size_t idx = 0, i;
+        const size_t start = nextListener++ % pfds.size();
 
-        while (strs[idx] != nullptr) {
-            ret.push_back(PrimitiveMemonly(&strs[idx]));
-            for (i = idx; strs[i] != nullptr; i++) {}
-            idx = i + 1;
+        for (size_t l = 0; l < pfds.size() && n < maxN; l++) {
+            const PollFdType &lpfd = pfds[(start + l) % pfds.size()];
+            const int family = families[(start + l) % pfds.size()];
+
+            while (n < maxN) {
+                SOCKET s = accept(lpfd.s, nullptr, nullptr);
+                if (s == INVALID_SOCKET)
+                    if (GNetNat.ErrorWouldBlock())            break;
+                    else if (GNetNat.ErrorAcceptTransient()) continue;
+                    else                                      throw NetFailureErrExc();
+
+                if (!GNetNat.SetupAccepted(s, family)) {
+                    LOG(WARNING) << "Accepted socket setup failure";
+                    closesocket(s);
+                    continue;
+                }
+
+                out->push_back(GNetNat.MakePollFdType(s));
+                n++;
+            }
         }
 
-        return ret;
+        return n;
     }
 
-    void PrimitiveMemonly::WriteU(deque<Fragment>* w) {
-        assert(0);
-        write.insert(write.end(), w->begin(), w->end());
-        w->clear();
+    bool NetFuncs::ErrorWouldBlock() {
+        int e = WSAGetLastError();
+        return e == WSAEWOULDBLOCK || e == WSAEINTR || e == WSAEINPROGRESS;
     }
 
-    void PrimitiveMemonly::ReadU(deque<Fragment>* w) {
-        if (read.empty()) throw NetDisconnectExc();
-        w->push_back(read.front());
-        read.pop_front();
-        throw NetBlockExc();
+    /* Connection went away between readiness and accept, skip it and keep draining */
+    bool NetFuncs::ErrorAcceptTransient() {
+        int e = WSAGetLastError();
+        return e == WSAECONNRESET;
     }
 
-    ConToken::ConToken(uint32_t id) : id(id) {}
+    /* Options for an accepted socket, in one place (SOCK_CLOEXEC equivalent included) */
+    bool NetFuncs::SetupAccepted(SOCKET s, int family) {
+        int nodelay = 1;
 
-    bool ConTokenLess::operator() (const ConToken &lhs, const ConToken &rhs) const {
-        return lhs.id < rhs.id;
-    }
+        if (!SetHandleInformation((HANDLE)s, HANDLE_FLAG_INHERIT, 0))
+            return false;
 
-    ConTokenGen::ConTokenGen() : maxTokens(100) { for (int i = 0; i < maxTokens; i++) toks.insert(ConToken(i)); }
+        if (family != AF_UNIX && setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof nodelay) == SOCKET_ERROR)
+            return false;
 
-    ConToken ConTokenGen::GetToken() {
-        if (!toks.size()) throw exception("Out of tokens");
-        ConToken w = *toks.begin();
-        toks.erase(toks.begin());
-        return w;
+        return true;
     }
 
-    void ConTokenGen::ReturnToken(ConToken tok) {
-        toks.insert(tok);
+    /* Winsock takes a boolean, Linux the pending request queue length */
+    bool NetFuncs::SetupFastOpen(SOCKET s, int qlen) {
+#ifdef TCP_FASTOPEN
+#ifdef _WIN32
+        /* Windows takes an on / off flag, the queue length is managed by the stack */
+        (void)qlen;
+        DWORD w = 1;
+#else
+        int w = qlen;
+#endif
+        return setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, (const char *)&w, sizeof w) != SOCKET_ERROR;
+#else
+        (void)s; (void)qlen;
+        return false;
+#endif
     }
 
-    /* NOTE: 'cont(0, 0, bool(fst.size()))' skips an empty 'fst' */
-    PackContIt::PackContIt(const deque<Fragment> &fst, const deque<Fragment> &snd) : fst(&fst), snd(&snd), cont(0, 0, bool(fst.size())), canary(0), canary_limit(1000) {}
-
-    void PackContIt::AdvancePart() {
-        const deque<Fragment> &curr = cont.inIn ? *fst : *snd;
-        if ((++cont.partNo) >= CurFragData().size())
-            AdvanceFrag();
+    /* Connections are only reported by accept once data arrived (or the timeout expired) */
+    bool NetFuncs::SetupDeferAccept(SOCKET s, int secs) {
+#ifdef TCP_DEFER_ACCEPT
+        return setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char *)&secs, sizeof secs) != SOCKET_ERROR;
+#else
+        (void)s; (void)secs;
+        return false;
+#endif
     }
 
-    void PackContIt::AdvanceToPart(size_t w) {
-        const deque<Fragment> &curr = cont.inIn ? *fst : *snd;
-        cont.partNo = ZZMIN(w, cont.fragNo >= curr.size() ? 0 : curr[cont.fragNo].data.size());
-    }
+    ReadSizer::ReadSizer() : avg(MAGIC_READ_SIZE), cap(0) {}
 
-    void PackContIt::AdvanceFrag() {
-        const deque<Fragment> &curr = cont.inIn ? *fst : *snd;
-        if (cont.fragNo > curr.size()) assert(0);
+    /* 'pending' is the FIONREAD hint. Reading exactly that much keeps small messages small,
+       the average covers data that arrives between the hint and the read. */
+    size_t ReadSizer::NextSize(size_t pending) const {
+        size_t want = ZZMAX(pending, (size_t)avg);
+        want = ZZMAX(want, (size_t)READ_SIZE_MIN);
+        want = ZZMIN(want, (size_t)(cap ? cap : READ_SIZE_MAX));
+        return want;
+    }
 
-        size_t nFp = ZZMIN(cont.fragNo + 1, curr.size());
-        if (cont.inIn && nFp == curr.size()) cont = PackContR(0, 0, false);
-        else                                 cont.fragNo = nFp;
+    void ReadSizer::Observe(size_t got, size_t want) {
+        const size_t lim = cap ? cap : READ_SIZE_MAX;
 
-        AdvanceToPart(0);
+        /* A full read means the peer has more, double instead of averaging in */
+        if (got >= want) avg = (uint32_t)ZZMIN(ZZMAX((size_t)avg, want) * 2, lim);
+        else             avg = (uint32_t)((avg * 7 + got) / 8);
     }
 
-    const string & PackContIt::CurFragData() const {
-        const deque<Fragment> &curr = cont.inIn ? *fst : *snd;
-        return curr.at(cont.fragNo).data;
-    }
+    /* POD for __declspec(thread), grown to the largest read a thread asked for and kept, not freed when it exits */
+    struct ReadScratchTls {
+        char *p;
+        size_t len;
+    };
 
-    size_t PackContIt::CurPart() const { return cont.partNo; }
+    static __declspec(thread) ReadScratchTls GReadScratch;
 
-    bool PackContIt::EndFragP() const {
-        if (canary++ > canary_limit) assert(0);
-        const deque<Fragment> &curr = cont.inIn ? *fst : *snd;
-        return !cont.inIn && cont.fragNo == curr.size();
-    }
+    /* Reads into a per thread scratch buffer (uninitialized, so want bytes are not zero-filled per call), with a
+       stack spill buffer as a second WSABUF (readv) so a read racing with new data still completes in one call.
+       The fragment is a right-sized copy of what arrived and never pins want bytes while queued.
+       A short read means the socket is drained, the would-block recv is skipped. */
+    void NetFuncs::PollFdTypeRead(const PollFdType &pfd, deque<NetData::Fragment>* w, ReadSizer *rs) {
+        char spill[MAGIC_READ_SIZE];
+        ReadScratchTls &t = GReadScratch;
 
-    bool PackContIt::SameFragP(const PackContIt &rhs) const {
-        if (canary++ > canary_limit) assert(0);
-        return cont.inIn == rhs.cont.inIn && cont.fragNo == rhs.cont.fragNo;
-    }
+        if (!rs->cap) rs->cap = (uint32_t)ZZMIN(PollFdTypeRcvBuf(pfd), (size_t)READ_SIZE_MAX);
 
-    void PackContIt::GetFromTo(const PackContIt &from, const PackContIt &to, string *accum) {
-        PackContIt it = from;
+        for (;;) {
+            u_long pending = 0;
+            if (ioctlsocket(pfd.s, FIONREAD, &pending) == SOCKET_ERROR)
+                pending = 0;
+
+            const size_t want = rs->NextSize(pending);
+            if (t.len < want) {
+                delete[] t.p;
+                t.p = new char[want];
+                t.len = want;
+            }
 
-        /* it.CurPart() is from.CurPart() the first time, and 0 (From it.AdvanceFrag()) afterwards */
-        for (; !it.SameFragP(to); it.AdvanceFrag())
-            accum->append(it.CurFragData().substr(it.CurPart(), string::npos));
+            WSABUF bufs[2];
+            bufs[0].buf = t.p;
+            bufs[0].len = (ULONG)want;
+            bufs[1].buf = spill;
+            bufs[1].len = MAGIC_READ_SIZE;
 
-        if (!it.EndFragP())
-            accum->append(it.CurFragData().substr(0, to.CurPart()));
-    }
+            DWORD r = 0, flags = 0;
+            if (WSARecv(pfd.s, bufs, 2, &r, &flags, nullptr, nullptr) == SOCKET_ERROR)
+                if (ErrorWouldBlock()) throw NetData::NetBlockExc();
+                else                   throw NetFailureErrExc();
+            if (r == 0)                throw NetData::NetDisconnectExc();
 
-    MessSock::Staged_t::Staged_t() : r(make_shared<vector<StagedRead_t> >()), d(make_shared<vector<StagedDisc_t> >()) {}
+            rs->Observe(r, want);
 
-    MessSock::CtData::CtData(PollFdType pfd) : pfd(pfd), in(), out(), knownClosed(false) {}
+            NetData::Buf buf(t.p, ZZMIN((size_t)r, want));
+            if (r > want) buf.append(spill, r - want);
 
-    vector<PollFdType> MessSock::GetPollFds() {
-        vector<PollFdType> curCons;
-        for (auto &i : cons) curCons.push_back(i.second.pfd);
+            /* FIXME: EmptyStamp */
+            w->push_back(NetData::Fragment(NetData::EmptyStamp(), move(buf)));
 
-        return curCons;
+            if (r < want + MAGIC_READ_SIZE) throw NetData::NetBlockExc();
+        }
+    };
+
+    /* One gathering send, bytes sent (possibly fewer than offered) or NetBlockExc if none */
+    size_t NetFuncs::PollFdTypeWrite(const PollFdType &pfd, WSABUF *bufs, size_t n) {
+        DWORD sent = 0;
+        if (WSASend(pfd.s, bufs, (DWORD)n, &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+            if (ErrorWouldBlock()) throw NetData::NetBlockExc();
+            else                   throw NetFailureErrExc();
+        return sent;
     }
 
-    void MessSock::UpdateCons() {
-        numCons = cons.size();
-        aux.RebuildPollFrom(GetPollFds());
-    };
+    size_t NetFuncs::PollFdTypeRcvBuf(const PollFdType &pfd) {
+        int sz = 0;
+        int len = sizeof sz;
+        if (getsockopt(pfd.s, SOL_SOCKET, SO_RCVBUF, (char *)&sz, &len) == SOCKET_ERROR || sz <= 0)
+            return MAGIC_READ_SIZE;
+        return sz;
+    }
+
+    PollFdType NetFuncs::MakePollFdType(SOCKET s) {
+        return PollFdType(s);
+    }
 
-    void MessSock::AddConsMulti(const vector<PollFdType>& pfds, const vector<ConToken> toks, const vector<CtData> cts) {
-        size_t i;
+    /* Connects blocking (local, completes or fails right away), then switches to non-blocking like accepted sockets */
+    PollFdType NetFuncs::ConnectUnix(const string &path) {
+#if defined(NET_HAVE_AF_UNIX)
+        sockaddr_un sa;
+        SOCKET s = INVALID_SOCKET;
 
         try {
-            for (i = 0; i < pfds.size(); i++)
-                if (!cons.insert(make_pair(toks[i], cts[i])).second) throw exception();
-        } catch (exception &e) {
-            LOG(INFO) << "Insertion failure in AddConsMulti (Attempt to insert existing ConToken?)";
 
-            for (size_t j = 0; j < i; i++)
-                if (cons.erase(toks[i]) != 1) throw exception("Abort");
+            if (!MakeUnixAddr(path, &sa))
+                throw exception("Socket path");
 
-            throw;
-        }
-    }
+            if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+                throw exception("Socket creation");
 
-    MessSock::MessSock() : numCons(0) {}
+            if (connect(s, (const sockaddr *)&sa, sizeof sa) == SOCKET_ERROR)
+                throw exception("Socket connect");
 
-    void MessSock::AcceptedConsMulti(const vector<PollFdType>& pfds) {
-        if (!pfds.size()) return;
+            u_long blockmode = 1;
+            if (ioctlsocket(s, FIONBIO, &blockmode) != NO_ERROR || !SetupAccepted(s, AF_UNIX))
+                throw exception("Socket setup");
 
-        vector<ConToken> newToks;
-        vector<CtData> newCts;
-        try {
-            for (auto &i : pfds) newToks.push_back(tokenGen.GetToken());
-            for (auto &i : pfds) newCts.push_back(i);
-            AddConsMulti(pfds, newToks, newCts);
-        } catch (exception &e) {
-            for (auto &i : newToks) tokenGen.ReturnToken(i);
+        } catch (exception &) {
+            if (s != INVALID_SOCKET) closesocket(s);
             throw;
         }
 
-        UpdateCons();
+        return PollFdType(s);
+#else
+        throw exception("AF_UNIX not supported by this SDK");
+#endif
     }
 
-    vector<ConToken> MessSock::GetConTokens() const {
-        vector<ConToken> ret;
-        for (auto &i : cons) ret.push_back(i.first);
-        return ret;
+    /* Interest stays as set by AddPollFd / SetPollEvents */
+    void MessSockSlave::ReadyForPoll() {
+        for (size_t i = 0; i < pfds.size(); i++)
+            pfds[i].revents = 0;
+    };
+
+    void MessSockSlave::SetPollEvents(size_t idx, short events) {
+        pfds[idx].events = events;
     }
 
-    MessSock::Staged_t MessSock::StagedRead() {
-        MessSock::Staged_t ret;
+    short MessSockSlave::Revents(size_t idx) const {
+        return pfds[idx].revents;
+    }
+
+    /* Indices of entries with something to read (or an error / hangup to notice) */
+    vector<size_t> MessSockSlave::PerformPoll() {
+        vector<size_t> ret;
+
+        int r = WSAPoll(pfds.data(), pfds.size(), 0);
+        if (r == SOCKET_ERROR) 
+            throw NetFailureErrExc();
+
+        for (size_t i = 0; i < pfds.size() && ret.size() < (size_t)r; i++)
+            if (pfds[i].revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) ret.push_back(i);
+
+        return ret;
+    }
+
+    size_t MessSockSlave::AddPollFd(const PollFdType &p) {
+        pollfd w = {0};
+        w.fd = p.s;
+        w.events = POLLIN;
+        pfds.push_back(w);
+        return pfds.size() - 1;
+    }
+
+    /* Swap with last, the entry previously at the end now lives at idx */
+    void MessSockSlave::RemovePollFd(size_t idx) {
+        pfds[idx] = pfds.back();
+        pfds.pop_back();
+    }
+
+    void MessSockSlave::RebuildPollFrom(const vector<PollFdType> &p) {
+        pfds.resize(p.size());
+
+        for (size_t i = 0; i < p.size(); i++) {
+            /* FIXME: Some kind of PollFdType::ExtractInto */
+            pfds[i].fd = p[i].s;
+            pfds[i].events = POLLIN;
+        }
+
+        ReadyForPoll();
+    }
+
+    /* One direction, head and tail on separate cache lines so producer and consumer don't share one */
+    struct ShmRing {
+        atomic<uint64_t> head;     /* Bytes ever written, producer only */
+        char pad0[64 - sizeof(atomic<uint64_t>)];
+        atomic<uint64_t> tail;     /* Bytes ever read, consumer only */
+        atomic<uint32_t> sleeping; /* Consumer is (about to be) waiting on the doorbell */
+        atomic<uint32_t> closed;   /* Producer side is gone */
+        char pad1[64 - sizeof(atomic<uint64_t>) - 2 * sizeof(atomic<uint32_t>)];
+    };
+
+    struct ShmHdr {
+        uint32_t magic;
+        uint32_t cap;
+        char pad[56];
+        ShmRing r[2];
+    };
+
+    PrimitiveShm::PrimitiveShm() : map(NULL), hdr(nullptr), side(0) {
+        bell[0] = bell[1] = NULL;
+        ring[0] = ring[1] = nullptr;
+    }
+
+    PrimitiveShm::~PrimitiveShm() {
+        if (hdr) {
+            Close();
+            UnmapViewOfFile(hdr);
+        }
+        for (auto &i : bell) if (i) CloseHandle(i);
+        if (map) CloseHandle(map);
+    }
+
+    void PrimitiveShm::Attach(const string &name, bool create, uint32_t cap) {
+        side = create ? 0 : 1;
+
+        if (create) {
+            if (!cap || (cap & (cap - 1)))
+                throw exception("Shm capacity not a power of two");
+            map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)(sizeof(ShmHdr) + 2 * (size_t)cap), name.c_str());
+            /* Someone's ring already, initializing it would pull it from under them */
+            if (map && GetLastError() == ERROR_ALREADY_EXISTS) {
+                CloseHandle(map);
+                map = NULL;
+                throw exception("Shm mapping exists");
+            }
+        } else {
+            map = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        }
+        if (!map)
+            throw exception("Shm mapping");
+
+        void *v = MapViewOfFile(map, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (!v) {
+            CloseHandle(map);
+            map = NULL;
+            throw exception("Shm view");
+        }
+        hdr = (ShmHdr *)v;
+
+        if (create) {
+            new (hdr) ShmHdr();
+            hdr->cap = cap;
+            hdr->magic = SHM_MAGIC;
+        } else if (hdr->magic != SHM_MAGIC) {
+            throw exception("Shm header");
+        }
+
+        ring[0] = (char *)(hdr + 1);
+        ring[1] = ring[0] + hdr->cap;
+
+        for (int i = 0; i < 2; i++) {
+            const string bn = name + (i ? ".bell1" : ".bell0");
+            bell[i] = create ? CreateEventA(NULL, FALSE, FALSE, bn.c_str()) : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, bn.c_str());
+            if (!bell[i])
+                throw exception("Shm doorbell");
+        }
+    }
+
+    shared_ptr<PrimitiveShm> PrimitiveShm::Create(const string &name, uint32_t cap) {
+        shared_ptr<PrimitiveShm> ret(new PrimitiveShm());
+        ret->Attach(name, true, cap);
+        return ret;
+    }
+
+    shared_ptr<PrimitiveShm> PrimitiveShm::Open(const string &name) {
+        shared_ptr<PrimitiveShm> ret(new PrimitiveShm());
+        ret->Attach(name, false, 0);
+        return ret;
+    }
+
+    /* Copies as much as fits, what doesn't stays in w (and NetBlockExc is thrown) */
+    void PrimitiveShm::WriteU(deque<NetData::Fragment>* w) {
+        ShmRing &q = hdr->r[side];
+        const uint64_t cap = hdr->cap;
+        const uint64_t head = q.head.load(memory_order_relaxed);
+        const uint64_t tail = q.tail.load(memory_order_acquire);
+        uint64_t h = head;
+
+        if (hdr->r[1 - side].closed.load(memory_order_acquire))
+            throw NetData::NetDisconnectExc();
+
+        while (!w->empty()) {
+            NetData::Buf &d = w->front().data;
+            const size_t k = (size_t)ZZMIN((uint64_t)d.size(), cap - (h - tail));
+            const size_t off = (size_t)(h & (cap - 1));
+            const size_t k1 = ZZMIN(k, (size_t)cap - off);
+
+            memcpy(ring[side] + off, d.data(), k1);
+            memcpy(ring[side], d.data() + k1, k - k1);
+            h += k;
+
+            if (k < d.size()) { d.erase(0, k); break; }
+            w->pop_front();
+        }
+
+        if (h != head) {
+            q.head.store(h, memory_order_seq_cst);
+            if (q.sleeping.load(memory_order_seq_cst)) SetEvent(bell[side]);
+        }
+
+        if (!w->empty()) throw NetData::NetBlockExc();
+    }
+
+    /* Everything available as one fragment, same exceptions as PollFdTypeRead */
+    void PrimitiveShm::ReadU(deque<NetData::Fragment>* w) {
+        ShmRing &q = hdr->r[1 - side];
+        const uint64_t cap = hdr->cap;
+        const uint64_t tail = q.tail.load(memory_order_relaxed);
+        /* Closed before head, so nothing written ahead of the close is missed */
+        const bool closed = q.closed.load(memory_order_acquire) != 0;
+        const uint64_t head = q.head.load(memory_order_acquire);
+
+        if (head == tail) {
+            if (closed) throw NetData::NetDisconnectExc();
+            else        throw NetData::NetBlockExc();
+        }
+
+        const size_t n = (size_t)ZZMIN(head - tail, (uint64_t)READ_SIZE_MAX);
+        const size_t off = (size_t)(tail & (cap - 1));
+        const size_t k1 = ZZMIN(n, (size_t)cap - off);
+
+        NetData::Buf d;
+        d.reserve(n);
+        d.append(ring[1 - side] + off, k1);
+        d.append(ring[1 - side], n - k1);
+
+        q.tail.store(tail + n, memory_order_release);
+
+        w->push_back(NetData::Fragment(NetData::EmptyStamp(), move(d)));
+        throw NetData::NetBlockExc();
+    }
+
+    /* Blocks up to ms for data (or the peer closing), true if there is something to read */
+    bool PrimitiveShm::Wait(DWORD ms) {
+        ShmRing &q = hdr->r[1 - side];
+
+        q.sleeping.store(1, memory_order_seq_cst);
+        if (q.head.load(memory_order_seq_cst) == q.tail.load(memory_order_relaxed) && !q.closed.load(memory_order_seq_cst))
+            WaitForSingleObject(bell[1 - side], ms);
+        q.sleeping.store(0, memory_order_relaxed);
+
+        return q.head.load(memory_order_acquire) != q.tail.load(memory_order_relaxed) || q.closed.load(memory_order_acquire);
+    }
+
+    void PrimitiveShm::Close() {
+        if (hdr->r[side].closed.exchange(1)) return;
+        SetEvent(bell[side]);
+    }
+
+    PrimitiveDatagram::PrimitiveDatagram(const ListenSpec &spec, bool offload) : s(INVALID_SOCKET), offload(false), segSize(0), rbuf(DGRAM_SIZE_MAX) {
+        struct addrinfo *res = nullptr;
+        struct addrinfo hints = {0};
+        hints.ai_family = spec.family;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+        hints.ai_flags = AI_PASSIVE;
+
+        try {
+
+            if (getaddrinfo(spec.addr.empty() ? nullptr : spec.addr.c_str(), spec.port.c_str(), &hints, &res))
+                throw exception("Getaddrinfo");
+
+            if ((s = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == INVALID_SOCKET)
+                throw exception("Socket creation");
+
+            if (res->ai_family == AF_INET6) {
+                int v6only = !spec.dualStack;
+                if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof v6only) == SOCKET_ERROR)
+                    throw exception("Socket dual stack mode");
+            }
+
+            if (bind(s, res->ai_addr, res->ai_addrlen) == SOCKET_ERROR)
+                throw exception("Socket bind");
+
+            u_long blockmode = 1;
+            if (ioctlsocket(s, FIONBIO, &blockmode) != NO_ERROR)
+                throw exception("Socket nonblocking mode");
+
+            if (!SetHandleInformation((HANDLE)s, HANDLE_FLAG_INHERIT, 0))
+                throw exception("Socket inheritance");
+
+            freeaddrinfo(res);
+
+        } catch (exception &) {
+            if (res) freeaddrinfo(res);
+            if (s != INVALID_SOCKET) closesocket(s);
+            throw;
+        }
+
+        /* Optional, without it every datagram is its own call */
+#if defined(UDP_RECV_MAX_COALESCED_SIZE) && defined(UDP_SEND_MSG_SIZE)
+        if (offload) {
+            DWORD uro = DGRAM_OFFLOAD_BYTES_MAX, uso = 0;
+            this->offload =
+                setsockopt(s, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, (const char *)&uro, sizeof uro) != SOCKET_ERROR &&
+                setsockopt(s, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (const char *)&uso, sizeof uso) != SOCKET_ERROR;
+        }
+#endif
+        if (offload && !this->offload)
+            LOG(WARNING) << "UDP segmentation offload unavailable on " << spec.port;
+    }
+
+    PrimitiveDatagram::~PrimitiveDatagram() {
+        closesocket(s);
+    }
+
+    bool PrimitiveDatagram::OffloadP() const {
+        return offload;
+    }
+
+    void PrimitiveDatagram::SetSegSize(DWORD seg) {
+#ifdef UDP_SEND_MSG_SIZE
+        if (seg == segSize) return;
+        if (setsockopt(s, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (const char *)&seg, sizeof seg) == SOCKET_ERROR)
+            throw NetFailureErrExc();
+        segSize = seg;
+#endif
+    }
+
+    /* Up to maxN datagrams (with URO, coalesced runs of one peer count once), each copied out of the scratch buffer into a pooled Buf.
+       A datagram truncated to the scratch size (WSAEMSGSIZE) is dropped. */
+    size_t PrimitiveDatagram::RecvBatch(vector<Datagram_t> *out, size_t maxN) {
+        size_t n = 0;
+
+        while (n < maxN) {
+            sockaddr_storage peer;
+            int peerLen = sizeof peer;
+
+            int r = recvfrom(s, rbuf.data(), (int)rbuf.size(), 0, (sockaddr *)&peer, &peerLen);
+            if (r == SOCKET_ERROR) {
+                const int e = WSAGetLastError();
+                if (GNetNat.ErrorWouldBlock())        break;
+                else if (e == WSAEMSGSIZE)            { LOG(WARNING) << "Dropping oversized datagram"; continue; }
+                else if (e == WSAECONNRESET)          continue; /* ICMP port unreachable from an earlier send */
+                else                                  throw NetFailureErrExc();
+            }
+
+            /* Filled in place, Datagram_t is not cheap to copy */
+            out->resize(out->size() + 1);
+            Datagram_t &d = out->back();
+            d.peer = peer;
+            d.peerLen = peerLen;
+            d.data.assign(rbuf.data(), r);
+            n++;
+        }
+
+        return n;
+    }
+
+    /* Sends from the front of q until it would block or maxN went out. With USO, a run of equal-sized
+       datagrams to one peer is handed over as one buffer the stack cuts back into datagrams. */
+    size_t PrimitiveDatagram::SendBatch(deque<Datagram_t> *q, size_t maxN) {
+        size_t n = 0;
+        NetData::Buf cat;
+
+        while (!q->empty() && n < maxN) {
+            const Datagram_t &f = q->front();
+            size_t k = 1;
+
+            if (offload) {
+                const size_t seg = f.data.size();
+                while (k < q->size() && n + k < maxN && (k + 1) * seg <= DGRAM_OFFLOAD_BYTES_MAX &&
+                    (*q)[k].data.size() == seg && (*q)[k].peerLen == f.peerLen && !memcmp(&(*q)[k].peer, &f.peer, f.peerLen))
+                    k++;
+            }
+
+            const char *data = f.data.data();
+            size_t len = f.data.size();
+
+            if (k > 1) {
+                cat.clear();
+                for (size_t i = 0; i < k; i++) cat.append((*q)[i].data);
+                data = cat.data();
+                len = cat.size();
+                SetSegSize((DWORD)f.data.size());
+            } else if (offload) {
+                SetSegSize(0);
+            }
+
+            int r = sendto(s, data, (int)len, 0, (const sockaddr *)&f.peer, f.peerLen);
+            if (r == SOCKET_ERROR)
+                if (GNetNat.ErrorWouldBlock()) break;
+                else                           throw NetFailureErrExc();
+
+            for (size_t i = 0; i < k; i++) q->pop_front();
+            n += k;
+        }
+
+        return n;
+    }
+
+    /* Messages are { uint32_t type, uint32_t len } followed by len bytes.
+       Sockets travel as WSADuplicateSocket protocol info for the peer's process, the Winsock counterpart of SCM_RIGHTS. */
+    /* Takes ownership of pfd, also when construction fails */
+    HandoffChannel::HandoffChannel(PollFdType pfd) : pfd(pfd), peerPid(0), rbuf(), wbuf(), unacked() {
+        const uint32_t pid = GetCurrentProcessId();
+
+        try {
+            SendMsg(HANDOFF_HELLO, (const char *)&pid, sizeof pid, string());
+        } catch (...) {
+            closesocket(pfd.s);
+            throw;
+        }
+    }
+
+    HandoffChannel::~HandoffChannel() {
+        for (auto &i : unacked) closesocket(i);
+        closesocket(pfd.s);
+    }
+
+    bool HandoffChannel::PeerKnown() const {
+        return peerPid != 0;
+    }
+
+    /* Queued behind anything not yet written, what the socket won't take now goes out with a later Flush / Recv */
+    void HandoffChannel::SendMsg(uint32_t type, const char *data, size_t len, const string &meta) {
+        const uint32_t hdr[2] = { type, (uint32_t)(len + meta.size()) };
+        wbuf.reserve(wbuf.size() + sizeof hdr + hdr[1]);
+        wbuf.append((const char *)hdr, sizeof hdr);
+        wbuf.append(data, len);
+        wbuf.append(meta);
+        Flush();
+    }
+
+    /* True once everything queued is written, otherwise poll for POLLOUT and call again */
+    bool HandoffChannel::Flush() {
+        size_t off = 0;
+
+        while (off < wbuf.size()) {
+            int r = send(pfd.s, wbuf.data() + off, (int)(wbuf.size() - off), 0);
+            if (r == SOCKET_ERROR)
+                if (GNetNat.ErrorWouldBlock()) break;
+                else                           throw NetFailureErrExc();
+            off += r;
+        }
+
+        wbuf.erase(0, off);
+        return wbuf.empty();
+    }
+
+    /* Our copy of s is closed once the peer acknowledges it (see Recv) */
+    void HandoffChannel::Send(SOCKET s, const string &meta) {
+        WSAPROTOCOL_INFOW info;
+
+        if (!peerPid)
+            throw exception("Handoff peer unknown");
+
+        if (WSADuplicateSocketW(s, peerPid, &info) == SOCKET_ERROR)
+            throw NetFailureErrExc();
+
+        SendMsg(HANDOFF_SOCK, (const char *)&info, sizeof info, meta);
+        unacked.push_back(s);
+    }
+
+    /* Handles whatever arrived: hellos, acks and sockets, the latter are adopted (non-blocking, not inheritable) into out */
+    size_t HandoffChannel::Recv(vector<Handoff_t> *out) {
+        size_t n = 0;
+        bool closed = false;
+        char tmp[4096];
+
+        Flush();
+
+        for (;;) {
+            int r = recv(pfd.s, tmp, sizeof tmp, 0);
+            if (r == SOCKET_ERROR)
+                if (GNetNat.ErrorWouldBlock()) break;
+                else                           throw NetFailureErrExc();
+            if (r == 0) { closed = true; break; }
+            rbuf.append(tmp, r);
+        }
+
+        size_t off = 0, acks = 0;
+        uint32_t hdr[2];
+
+        while (rbuf.size() - off >= sizeof hdr) {
+            memcpy(hdr, rbuf.data() + off, sizeof hdr);
+            if (rbuf.size() - off - sizeof hdr < hdr[1]) break;
+
+            const char *body = rbuf.data() + off + sizeof hdr;
+
+            if (hdr[0] == HANDOFF_HELLO && hdr[1] >= sizeof peerPid) {
+                memcpy(&peerPid, body, sizeof peerPid);
+            } else if (hdr[0] == HANDOFF_ACK && !unacked.empty()) {
+                closesocket(unacked.front());
+                unacked.pop_front();
+            } else if (hdr[0] == HANDOFF_SOCK && hdr[1] >= sizeof(WSAPROTOCOL_INFOW)) {
+                WSAPROTOCOL_INFOW info;
+                memcpy(&info, body, sizeof info);
+
+                SOCKET s = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+                u_long blockmode = 1;
+
+                if (s == INVALID_SOCKET || ioctlsocket(s, FIONBIO, &blockmode) != NO_ERROR || !SetHandleInformation((HANDLE)s, HANDLE_FLAG_INHERIT, 0)) {
+                    LOG(WARNING) << "Handed off socket adoption failure";
+                    if (s != INVALID_SOCKET) closesocket(s);
+                } else {
+                    Handoff_t h = { GNetNat.MakePollFdType(s), string(body + sizeof info, hdr[1] - sizeof info) };
+                    out->push_back(h);
+                    n++;
+                }
+
+                /* Acked even on failure, the sender's copy is of no further use to either side */
+                acks++;
+            } else {
+                LOG(WARNING) << "Unexpected handoff message " << hdr[0];
+            }
+
+            off += sizeof hdr + hdr[1];
+        }
+
+        rbuf.erase(0, off);
+
+        /* Only once the messages are consumed, a failing send must not have them (and their sockets) parsed again */
+        for (; acks; acks--) SendMsg(HANDOFF_ACK, nullptr, 0, string());
+
+        if (closed) throw NetData::NetDisconnectExc();
+
+        return n;
+    }
+
+};
+
+namespace NetStuff {
+
+    PrimitiveMemonly::PrimitiveMemonly(const char **strs) {
+        for (size_t i = 0; strs[i] != nullptr; i++)
+            read.push_back(Fragment(EmptyStamp(), string(strs[i])));
+    }
+
+    vector<PrimitiveMemonly> PrimitiveMemonly::MakePrims(const char **strs) {
+        vector<PrimitiveMemonly> ret;
+        size_t idx = 0, i;
+
+        while (strs[idx] != nullptr) {
+            ret.push_back(PrimitiveMemonly(&strs[idx]));
+            for (i = idx; strs[i] != nullptr; i++) {}
+            idx = i + 1;
+        }
+
+        return ret;
+    }
+
+    void PrimitiveMemonly::WriteU(deque<Fragment>* w) {
+        assert(0);
+        write.insert(write.end(), w->begin(), w->end());
+        w->clear();
+    }
+
+    void PrimitiveMemonly::ReadU(deque<Fragment>* w) {
+        if (read.empty()) throw NetDisconnectExc();
+        w->push_back(read.front());
+        read.pop_front();
+        throw NetBlockExc();
+    }
+
+    ConToken::ConToken(uint32_t id) : id(id) {}
+
+    /* Takes a specific token if still free (e.g. one carried over by HotRestart) */
+    bool ConTokenGen::Claim(ConToken tok) {
+        return toks.erase(tok) != 0;
+    }
+
+    bool ConTokenGen::Empty() const {
+        return toks.empty();
+    }
+
+    bool ConTokenLess::operator() (const ConToken &lhs, const ConToken &rhs) const {
+        return lhs.id < rhs.id;
+    }
+
+    ConTokenGen::ConTokenGen() : maxTokens(100) { for (int i = 0; i < maxTokens; i++) toks.insert(ConToken(i)); }
+
+    ConToken ConTokenGen::GetToken() {
+        if (!toks.size()) throw exception("Out of tokens");
+        ConToken w = *toks.begin();
+        toks.erase(toks.begin());
+        return w;
+    }
+
+    void ConTokenGen::ReturnToken(ConToken tok) {
+        toks.insert(tok);
+    }
+
+    SegCursor::SegCursor() : segs(), ends(), seg(0), off(0), pos(0) {}
+
+    SegCursor::SegCursor(const deque<Fragment> &fst, const deque<Fragment> &snd) : segs(), ends(), seg(0), off(0), pos(0) {
+        Append(fst);
+        Append(snd);
+    }
+
+    void SegCursor::Append(const deque<Fragment> &deq) {
+        for (auto &i : deq) {
+            segs.push_back(&i.data);
+            ends.push_back(Size() + i.data.size());
+        }
+        /* Cursor may have been sitting at the end, or on empty segments */
+        Seek(pos);
+    }
+
+    size_t SegCursor::Pos() const { return pos; }
+
+    size_t SegCursor::Size() const { return ends.empty() ? 0 : ends.back(); }
+
+    bool SegCursor::EndP() const { return pos >= Size(); }
+
+    void SegCursor::Advance(size_t n) {
+        if (seg < segs.size() && off + n < segs[seg]->size()) { off += n; pos += n; }
+        else                                                  Seek(pos + n);
+    }
+
+    /* Lands on the first segment ending past 'abs', skipping empty ones. Past the end is (segs.size(), 0). */
+    void SegCursor::Seek(size_t abs) {
+        pos = ZZMIN(abs, Size());
+        seg = upper_bound(ends.begin(), ends.end(), pos) - ends.begin();
+        off = seg < segs.size() ? pos - (ends[seg] - segs[seg]->size()) : 0;
+    }
+
+    bool SegCursor::Find(char c, size_t *at) const {
+        size_t o = off;
+
+        for (size_t s = seg; s < segs.size(); s++, o = 0) {
+            const Buf &d = *segs[s];
+            const void *p = o < d.size() ? memchr(d.data() + o, c, d.size() - o) : nullptr;
+            if (p) {
+                *at = (ends[s] - d.size()) + ((const char *)p - d.data());
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /* Pointer into the buffer if [from, from+n) lies within one segment, nullptr otherwise */
+    const char * SegCursor::Contiguous(size_t from, size_t n) const {
+        size_t s = upper_bound(ends.begin(), ends.end(), from) - ends.begin();
+        if (s >= segs.size() || from + n > ends[s]) return nullptr;
+        return segs[s]->data() + (from - (ends[s] - segs[s]->size()));
+    }
+
+    bool SegCursor::Peek(size_t from, size_t n, char *dst) const {
+        if (from + n > Size()) return false;
+
+        for (size_t s = upper_bound(ends.begin(), ends.end(), from) - ends.begin(); n; s++) {
+            const size_t segStart = ends[s] - segs[s]->size();
+            const size_t k = ZZMIN(n, ends[s] - from);
+            memcpy(dst, segs[s]->data() + (from - segStart), k);
+            dst += k; from += k; n -= k;
+        }
+
+        return true;
+    }
+
+    template<typename T>
+    static void SegCursorGetRange(const SegCursor &c, size_t from, size_t to, T *accum, uint32_t *crc) {
+        to = ZZMIN(to, c.Size());
+        if (from >= to) return;
+
+        accum->reserve(accum->size() + (to - from));
+
+        for (size_t s = upper_bound(c.ends.begin(), c.ends.end(), from) - c.ends.begin(); from < to; s++) {
+            const size_t segStart = c.ends[s] - c.segs[s]->size();
+            const size_t k = ZZMIN(to, c.ends[s]) - from;
+            const char *p = c.segs[s]->data() + (from - segStart);
+            if (crc) *crc = Crc32c::Append(*crc, accum, p, k);
+            else     accum->append(p, k);
+            from += k;
+        }
+    }
+
+    void SegCursor::GetRange(size_t from, size_t to, string *accum) const {
+        SegCursorGetRange(*this, from, to, accum, (uint32_t *)nullptr);
+    }
+
+    void SegCursor::GetRange(size_t from, size_t to, Buf *accum) const {
+        SegCursorGetRange(*this, from, to, accum, (uint32_t *)nullptr);
+    }
+
+    /* GetRange, checksumming the bytes as they are copied */
+    uint32_t SegCursor::GetRangeCrc(size_t from, size_t to, Buf *accum) const {
+        uint32_t crc = 0;
+        SegCursorGetRange(*this, from, to, accum, &crc);
+        return crc;
+    }
+
+    /* Position as fragment / part of the two deques the cursor was built from, fstSegs being the size of the first */
+    PackContR SegCursor::ContR(size_t fstSegs) const {
+        if (seg < fstSegs) return PackContR(seg, off, true);
+        else               return PackContR(seg - fstSegs, off, false);
+    }
+
+    MessSock::Staged_t::Staged_t() : r(make_shared<vector<StagedRead_t> >()), d(make_shared<vector<StagedDisc_t> >()) {}
+
+    MessSock::CtData::CtData(PollFdType pfd, size_t pollIdx) : pfd(pfd), pollIdx(pollIdx), prim(), rs(), out(), writeListed(false), knownClosed(false), lastActive(0) {}
+
+    MessSock::CtData::CtData(shared_ptr<PrimitiveBase> prim) : pfd(GNetNat.MakePollFdType(INVALID_SOCKET)), pollIdx(0), prim(prim), rs(), out(), writeListed(false), knownClosed(false), lastActive(0) {}
+
+    MessSock::MessSock() : numCons(0), tick(0) {}
+
+    /* Registers each connection incrementally, the poll set is appended to, not rebuilt */
+    /* Returns the new connections' tokens (e.g. to pick their PipeSet::SetChain by listener) */
+    /* Sockets past the token limit are closed rather than registered, the result is shorter than pfds then */
+    vector<ConToken> MessSock::AcceptedConsMulti(const vector<PollFdType>& pfds) {
+        vector<ConToken> ret;
+
+        for (auto &i : pfds) {
+            if (tokenGen.Empty()) {
+                LOG(WARNING) << "Out of tokens, closing accepted socket";
+                closesocket(i.s);
+                continue;
+            }
+
+            ConToken tok = tokenGen.GetToken();
+
+            if (cons.find(tok) != cons.end()) {
+                LOG(INFO) << "Insertion failure in AcceptedConsMulti (Attempt to insert existing ConToken?)";
+                tokenGen.ReturnToken(tok);
+                throw exception("Abort");
+            }
+
+            cons.insert(make_pair(tok, CtData(i, aux.AddPollFd(i))));
+            cons.find(tok)->second.lastActive = tick;
+            pollToks.push_back(tok);
+            evOpened.push_back(tok);
+            ret.push_back(tok);
+        }
+
+        numCons = cons.size();
+        return ret;
+    }
+
+    /* Connections over other transports (see PrimitiveShm), read every StagedRead without polling.
+       Primitives past the token limit are not registered (they go when the caller drops them), the result is shorter then. */
+    vector<ConToken> MessSock::AcceptedPrims(const vector<shared_ptr<PrimitiveBase> > &prims) {
+        vector<ConToken> ret;
+
+        for (auto &i : prims) {
+            if (tokenGen.Empty()) {
+                LOG(WARNING) << "Out of tokens, primitive not registered";
+                continue;
+            }
+
+            ConToken tok = tokenGen.GetToken();
+            cons.insert(make_pair(tok, CtData(i)));
+            cons.find(tok)->second.lastActive = tick;
+            primToks.push_back(tok);
+            evOpened.push_back(tok);
+            ret.push_back(tok);
+        }
+
+        numCons = cons.size();
+        return ret;
+    }
+
+    vector<ConToken> MessSock::GetConTokens() const {
+        vector<ConToken> ret;
+        for (auto &i : cons) ret.push_back(i.first);
+        return ret;
+    }
+
+    MessSock::Staged_t MessSock::StagedRead() {
+        MessSock::Staged_t ret;
+
+        tick++;
+
+        ret.d->insert(ret.d->end(), writeDisc.begin(), writeDisc.end());
+        writeDisc.clear();
+
+        if (!numCons) return ret;
+
+        /* No poll call at all when only non-socket transports are connected */
+        if (!pollToks.empty()) {
+            aux.ReadyForPoll();
+
+            const vector<size_t> ready = aux.PerformPoll();
+
+            for (auto &idx : ready) {
+                auto it = cons.find(pollToks[idx]);
+
+                if (!it->second.relay) {
+                    StagedReadCon(it->first, it->second, &ret);
+                    continue;
+                }
+
+                /* Writable means the peer's pending bytes can move on */
+                const short rev = aux.Revents(idx);
+                if (rev & (POLLIN | POLLERR | POLLHUP)) RelayPump(it->first, it->second, &ret);
+                if (rev & POLLOUT) {
+                    auto ip = cons.find(it->second.relay->peer);
+                    RelayPump(ip->first, ip->second, &ret);
+                }
+            }
+        }
+
+        for (auto &i : primToks)
+            StagedReadCon(i, cons.find(i)->second, &ret);
+
+        return ret;
+    };
+
+    void MessSock::StagedReadCon(const ConToken &tok, CtData &ct, Staged_t *ret) {
+        if (ct.knownClosed) return;
+
+        deque<Fragment> w;
+
+        try {
+            if (ct.prim) ct.prim->ReadU(&w);
+            else         GNetNat.PollFdTypeRead(ct.pfd, &w, &ct.rs);
+        } catch (NetBlockExc &e) {
+            /* Nothing */
+        } catch (NetDisconnectExc &e) {
+            StagedDisc_t mgde = { tok, true };
+            ret->d->push_back(mgde);
+            ct.knownClosed = true;
+        } catch (NetFailureExc &e) {
+            StagedDisc_t mgde = { tok, false };
+            ret->d->push_back(mgde);
+            ct.knownClosed = true;
+        }
+
+        /* Might have read something even if a disconnect or failure occurred */
+        if (!w.empty()) {
+            StagedRead_t mgre = { tok, w };
+            ret->r->push_back(mgre);
+            ct.lastActive = tick;
+        }
+    }
+
+    /* A close cancels an open not yet reported, so a token is never both opened and closed in one
+       TakeConEvents batch: closes always refer to earlier batches and can be applied before opens,
+       also when the token was reused in between. */
+    static void ConEventClosed(vector<ConToken> *opened, vector<ConToken> *closed, const ConToken &tok) {
+        for (size_t i = 0; i < opened->size(); i++) {
+            if ((*opened)[i].id != tok.id) continue;
+            opened->erase(opened->begin() + i);
+            return;
+        }
+
+        closed->push_back(tok);
+    }
+
+    /* Closes and forgets connections StagedRead saw disconnect, their tokens become available again */
+    void MessSock::RemoveKnownClosed() {
+        for (auto it = cons.begin(); it != cons.end();) {
+            if (!it->second.knownClosed) { ++it; continue; }
+
+            Unlink(it->first, it->second);
+            if (!it->second.prim) closesocket(it->second.pfd.s);
+
+            tokenGen.ReturnToken(it->first);
+            ConEventClosed(&evOpened, &evClosed, it->first);
+
+            it = cons.erase(it);
+        }
+
+        numCons = cons.size();
+    }
+
+    bool MessSock::Enqueue(const ConToken &tok, const SharedBuf &data) {
+        auto it = cons.find(tok);
+        if (it == cons.end() || it->second.knownClosed || it->second.relay) return false;
+
+        CtData &ct = it->second;
+        if (!ct.out) ct.out = make_shared<deque<OutSeg> >();
+
+        OutSeg seg = { data, 0 };
+        ct.out->push_back(seg);
+
+        if (!ct.writeListed) {
+            writeToks.push_back(tok);
+            ct.writeListed = true;
+        }
+
+        return true;
+    }
+
+    /* Queued for the next StagedWrite, false for an unknown, closed or relayed connection */
+    bool MessSock::Send(const ConToken &tok, Buf &&data) {
+        if (data.empty()) return true;
+        return Enqueue(tok, make_shared<Buf>(move(data)));
+    }
+
+    /* Queues the same buffer on every connection, memory is one copy plus a reference per connection */
+    size_t MessSock::Broadcast(const vector<ConToken> &toks, const SharedBuf &data) {
+        size_t n = 0;
+        if (!data || data->empty()) return 0;
+        for (auto &i : toks) n += Enqueue(i, data) ? 1 : 0;
+        return n;
+    }
+
+    /* Bytes queued and not yet written */
+    size_t MessSock::Queued(const ConToken &tok) const {
+        auto it = cons.find(tok);
+        size_t n = 0;
+        if (it == cons.end() || !it->second.out) return 0;
+        for (auto &i : *it->second.out) n += i.buf->size() - i.off;
+        return n;
+    }
+
+    /* Writes what each connection has queued until its socket is full. Returns the number of connections still
+       backed up, a failed connection is reported by the next StagedRead. */
+    size_t MessSock::StagedWrite() {
+        size_t kept = 0;
+
+        for (size_t i = 0; i < writeToks.size(); i++) {
+            CtData &ct = cons.find(writeToks[i])->second;
+
+            try {
+                WriteCon(ct);
+            } catch (NetFailureExc &e) {
+                StagedDisc_t mgde = { writeToks[i], false };
+                writeDisc.push_back(mgde);
+                ct.knownClosed = true;
+                ct.out.reset();
+            }
+
+            if (ct.out && !ct.out->empty()) writeToks[kept++] = writeToks[i];
+            else                            ct.writeListed = false;
+        }
+
+        writeToks.erase(writeToks.begin() + kept, writeToks.end());
+        return kept;
+    }
+
+    /* Segments are gathered by reference, shared buffers are never copied per connection. Non-socket
+       transports take Fragments and so get a copy of what is pending. */
+    void MessSock::WriteCon(CtData &ct) {
+        deque<OutSeg> &q = *ct.out;
+
+        if (ct.prim) {
+            deque<Fragment> w;
+            size_t total = 0, left = 0;
+
+            for (auto &i : q) {
+                w.push_back(Fragment(EmptyStamp(), Buf(i.buf->data() + i.off, i.buf->size() - i.off)));
+                total += i.buf->size() - i.off;
+            }
+
+            try {
+                ct.prim->WriteU(&w);
+            } catch (NetBlockExc &e) {
+                /* Rest stays queued */
+            }
+
+            for (auto &i : w) left += i.data.size();
+            OutAdvance(&q, total - left);
+            return;
+        }
+
+        while (!q.empty()) {
+            WSABUF bufs[WRITE_IOV_MAX];
+            size_t n = 0, offered = 0;
+
+            for (auto it = q.begin(); it != q.end() && n < WRITE_IOV_MAX; ++it, n++) {
+                bufs[n].buf = (char *)it->buf->data() + it->off;
+                bufs[n].len = (ULONG)(it->buf->size() - it->off);
+                offered += bufs[n].len;
+            }
+
+            size_t sent;
+            try {
+                sent = GNetNat.PollFdTypeWrite(ct.pfd, bufs, n);
+            } catch (NetBlockExc &e) {
+                return;
+            }
+
+            OutAdvance(&q, sent);
+            if (sent < offered) return;
+        }
+    }
+
+    void MessSock::OutAdvance(deque<OutSeg> *q, size_t n) {
+        while (n) {
+            OutSeg &f = q->front();
+            const size_t k = ZZMIN(n, f.buf->size() - f.off);
+            f.off += k;
+            n -= k;
+            if (f.off == f.buf->size()) q->pop_front();
+        }
+    }
+
+    MessSock::RelayState::RelayState(ConToken peer) : peer(peer), buf(RELAY_BUF_SIZE), off(0), len(0), eof(false), shut(false) {}
+
+    /* From here on bytes arriving on either connection are sent straight out of the other, one copy through
+       a fixed buffer, no Fragments and no framing. Route before pairing (see Peek), anything already staged
+       stays with the caller. */
+    void MessSock::Pair(const ConToken &a, const ConToken &b) {
+        auto ia = cons.find(a), ib = cons.find(b);
+        if (ia == cons.end() || ib == cons.end() || a.id == b.id || ia->second.prim || ib->second.prim || ia->second.relay || ib->second.relay)
+            throw exception("Relay pair");
+
+        ia->second.relay = make_shared<RelayState>(b);
+        ib->second.relay = make_shared<RelayState>(a);
+    }
+
+    /* Copies up to n bytes of what is waiting on the socket without consuming them, e.g. a header to route on */
+    size_t MessSock::Peek(const ConToken &tok, char *dst, size_t n) const {
+        auto it = cons.find(tok);
+        if (it == cons.end() || it->second.prim) return 0;
+
+        int r = recv(it->second.pfd.s, dst, (int)n, MSG_PEEK);
+        return r == SOCKET_ERROR ? 0 : (size_t)r;
+    }
+
+    /* Sends src's pending bytes to dst, true once nothing is left */
+    bool MessSock::RelayFlush(CtData &src, CtData &dst) {
+        RelayState &r = *src.relay;
+
+        while (r.off < r.len) {
+            int n = send(dst.pfd.s, r.buf.data() + r.off, (int)(r.len - r.off), 0);
+            if (n == SOCKET_ERROR)
+                if (GNetNat.ErrorWouldBlock()) return false;
+                else                           throw NetFailureErrExc();
+            r.off += n;
+        }
+
+        r.off = r.len = 0;
+        return true;
+    }
+
+    /* Backpressure: a connection isn't read while its peer can't take more, the peer is watched for writability instead */
+    void MessSock::RelayEvents(const CtData &ct, const CtData &peer) {
+        short ev = 0;
+        if (!ct.relay->len && !ct.relay->eof) ev |= POLLIN;
+        if (peer.relay->len)                  ev |= POLLOUT;
+        aux.SetPollEvents(ct.pollIdx, ev);
+    }
+
+    /* Moves what src has to its peer. The pair is reported closed together: gracefully once both
+       directions reached end of stream and drained, as a failure if either socket errors. */
+    void MessSock::RelayPump(const ConToken &tok, CtData &src, Staged_t *ret) {
+        auto ip = cons.find(src.relay->peer);
+        CtData &dst = ip->second;
+        RelayState &r = *src.relay;
+        bool failed = false;
+
+        if (src.knownClosed) return;
+
+        try {
+            while (RelayFlush(src, dst) && !r.eof) {
+                int n = recv(src.pfd.s, r.buf.data(), (int)r.buf.size(), 0);
+                if (n == SOCKET_ERROR)
+                    if (GNetNat.ErrorWouldBlock()) break;
+                    else                           throw NetFailureErrExc();
+
+                if (n == 0) r.eof = true;
+                else        { r.len = n; src.lastActive = tick; }
+            }
+
+            if (r.eof && !r.len && !r.shut) {
+                shutdown(dst.pfd.s, SD_SEND);
+                r.shut = true;
+            }
+        } catch (NetFailureExc &e) {
+            failed = true;
+        }
+
+        if (failed || (r.shut && dst.relay->shut)) {
+            StagedDisc_t da = { tok, !failed }, db = { ip->first, !failed };
+            ret->d->push_back(da);
+            ret->d->push_back(db);
+            src.knownClosed = dst.knownClosed = true;
+            return;
+        }
+
+        RelayEvents(src, dst);
+        RelayEvents(dst, src);
+    }
+
+    /* Out of the poll set (or the non-socket list), the entry itself stays */
+    void MessSock::Unlink(const ConToken &tok, const CtData &ct) {
+        if (ct.writeListed)
+            writeToks.erase(find_if(writeToks.begin(), writeToks.end(), [&](const ConToken &t) { return t.id == tok.id; }));
+
+        if (ct.prim) {
+            primToks.erase(find_if(primToks.begin(), primToks.end(), [&](const ConToken &t) { return t.id == tok.id; }));
+        } else {
+            const size_t idx = ct.pollIdx;
+
+            aux.RemovePollFd(idx);
+            pollToks[idx] = pollToks.back();
+            pollToks.pop_back();
+            if (idx < pollToks.size()) cons.find(pollToks[idx])->second.pollIdx = idx;
+        }
+    }
+
+    /* What Detach would hand over, the connection stays registered */
+    bool MessSock::Snapshot(const ConToken &tok, PollFdType *pfd, deque<Fragment> *out) const {
+        auto it = cons.find(tok);
+        if (it == cons.end() || it->second.prim || it->second.relay) return false;
+
+        *pfd = it->second.pfd;
+        if (out && it->second.out)
+            for (auto &i : *it->second.out) out->push_back(Fragment(EmptyStamp(), Buf(i.buf->data() + i.off, i.buf->size() - i.off)));
+        return true;
+    }
+
+    /* Forgets a socket connection without closing it (it is someone else's now), queued output goes to out
+       (unless null). Relayed pairs stay. */
+    bool MessSock::Detach(const ConToken &tok, PollFdType *pfd, deque<Fragment> *out) {
+        if (!Snapshot(tok, pfd, out)) return false;
+        auto it = cons.find(tok);
+
+        Unlink(it->first, it->second);
+        tokenGen.ReturnToken(it->first);
+        ConEventClosed(&evOpened, &evClosed, it->first);
+        cons.erase(it);
+
+        numCons = cons.size();
+        return true;
+    }
+
+    /* Registers a connection handed over from elsewhere, *tok is the token wanted on entry and the one
+       given on return (the wanted one when free). Out of tokens, the socket is closed and false returned. */
+    bool MessSock::Adopt(PollFdType pfd, ConToken *tokp, deque<Fragment> *out) {
+        if (!tokenGen.Claim(*tokp)) {
+            if (tokenGen.Empty()) {
+                LOG(WARNING) << "Out of tokens, closing adopted socket";
+                closesocket(pfd.s);
+                return false;
+            }
+            *tokp = tokenGen.GetToken();
+        }
+        const ConToken tok = *tokp;
+
+        cons.insert(make_pair(tok, CtData(pfd, aux.AddPollFd(pfd)))).first->second.lastActive = tick;
+        pollToks.push_back(tok);
+        evOpened.push_back(tok);
+
+        for (auto &i : *out) Enqueue(tok, make_shared<Buf>(move(i.data)));
+        out->clear();
+
+        numCons = cons.size();
+        return true;
+    }
+
+    /* Connections opened / closed since the last call. Closes are of connections reported opened before,
+       apply them first (see ConEventClosed). */
+    void MessSock::TakeConEvents(vector<ConToken> *opened, vector<ConToken> *closed) {
+        opened->clear();
+        closed->clear();
+        opened->swap(evOpened);
+        closed->swap(evClosed);
+    }
+
+    /* Connections without reads for idleTicks give back their output buffer capacity, and restart read sizing small */
+    void MessSock::ReclaimIdle(uint32_t idleTicks) {
+        for (auto &it : cons) {
+            CtData &ct = it.second;
+            if (tick - ct.lastActive < idleTicks) continue;
+
+            if (ct.out && ct.out->empty()) ct.out.reset();
+            else if (ct.out)               ct.out->shrink_to_fit();
+
+            ct.rs.avg = MAGIC_READ_SIZE;
+        }
+    }
+
+    MessMemonly::CtData::CtData(PrimitiveMemonly pmo) : pmo(pmo) {}
+
+    MessMemonly::MessMemonly() : tokenGen(), cons(), numCons(0) {};
+
+    void MessMemonly::AcceptedConsMulti(const vector<PrimitiveMemonly> &mems) {
+        for (auto &i : mems) {
+            ConToken tok = tokenGen.GetToken();
+            if (!cons.insert(make_pair(tok, MessMemonly::CtData(i))).second) assert(0);
+            evOpened.push_back(tok);
+        }
+
+        numCons = cons.size();
+    }
+
+    void MessMemonly::TakeConEvents(vector<ConToken> *opened, vector<ConToken> *closed) {
+        opened->clear();
+        closed->clear();
+        opened->swap(evOpened);
+    }
+
+    vector<ConToken> MessMemonly::GetConTokens() const {
+        vector<ConToken> ret;
+
+        for (auto &i : cons)
+            ret.push_back(i.first);
+
+        return ret;
+    }
+
+    MessSock::Staged_t MessMemonly::StagedRead() {
+        auto r = make_shared<vector<MessSock::StagedRead_t> >();
+        auto d = make_shared<vector<MessSock::StagedDisc_t> >();
+        MessSock::Staged_t ret;
+        ret.r = r;
+        ret.d = d;
+
+        for (auto &i : cons) {
+            deque<Fragment> w;
+
+            try {
+                i.second.pmo.ReadU(&w);
+            } catch (NetBlockExc &e) {
+                /* Nothing */
+            } catch (NetDisconnectExc &e) {
+                MessSock::StagedDisc_t mgde = { i.first, true };
+                ret.d->push_back(mgde);
+            } catch (NetFailureExc &e) {
+                MessSock::StagedDisc_t mgde = { i.first, false };
+                ret.d->push_back(mgde);
+            }
+
+            if (!w.empty()) {
+                MessSock::StagedRead_t mgre = { i.first, w };
+                ret.r->push_back(mgre);
+            }
+        }
+
+        return ret;
+    }
+
+    MessDatagram::MessDatagram(shared_ptr<PrimitiveDatagram> prim) : prim(prim), tick(0), batchMax(DGRAM_BATCH_MAX) {}
+
+    vector<ConToken> MessDatagram::GetConTokens() const {
+        vector<ConToken> ret;
+        for (auto &i : peers) ret.push_back(i.first);
+        return ret;
+    }
+
+    /* One batch off the socket, consecutive datagrams of a peer end up in one StagedRead_t.
+       New peers get a token (and an opened event), datagrams beyond the token supply are dropped. */
+    MessSock::Staged_t MessDatagram::StagedRead() {
+        MessSock::Staged_t ret;
+
+        tick++;
+
+        rbatch.clear();
+        prim->RecvBatch(&rbatch, batchMax);
+
+        /* Each token staged once per batch (a pipe is remade once per read), however its peer's datagrams interleave */
+        map<uint32_t, size_t> slot;
+
+        for (auto &i : rbatch) {
+            const string key((const char *)&i.peer, i.peerLen);
+            auto it = byAddr.find(key);
+
+            if (it == byAddr.end()) {
+                if (tokenGen.Empty()) { LOG(WARNING) << "Out of tokens, dropping datagram"; continue; }
+
+                Peer p;
+                p.addr = i.peer;
+                p.addrLen = i.peerLen;
+                it = byAddr.insert(make_pair(key, tokenGen.GetToken())).first;
+                peers.insert(make_pair(it->second, p));
+                evOpened.push_back(it->second);
+            }
+
+            peers.find(it->second)->second.lastActive = tick;
+
+            auto sit = slot.find(it->second.id);
+            if (sit == slot.end()) {
+                sit = slot.insert(make_pair(it->second.id, ret.r->size())).first;
+                MessSock::StagedRead_t mgre = { it->second, deque<Fragment>() };
+                ret.r->push_back(mgre);
+            }
+            (*ret.r)[sit->second].in.push_back(Fragment(EmptyStamp(), move(i.data)));
+        }
+
+        return ret;
+    }
+
+    void MessDatagram::Send(const ConToken &tok, Buf &&data) {
+        auto it = peers.find(tok);
+        if (it == peers.end()) { LOG(ERROR) << "Send to inexistant " << tok.id; return; }
+
+        out.resize(out.size() + 1);
+        Datagram_t &d = out.back();
+        d.peer = it->second.addr;
+        d.peerLen = it->second.addrLen;
+        d.data.swap(data);
+    }
+
+    /* Whatever doesn't go out now stays queued for the next call */
+    size_t MessDatagram::Flush() {
+        return prim->SendBatch(&out, out.size());
+    }
+
+    /* UDP has no disconnect, peers silent for idleTicks are forgotten (closed event, token returned) */
+    void MessDatagram::ReclaimIdle(uint32_t idleTicks) {
+        for (auto it = byAddr.begin(); it != byAddr.end();) {
+            auto p = peers.find(it->second);
+            if (tick - p->second.lastActive < idleTicks) { ++it; continue; }
+
+            ConEventClosed(&evOpened, &evClosed, it->second);
+            tokenGen.ReturnToken(it->second);
+            peers.erase(p);
+            it = byAddr.erase(it);
+        }
+    }
+
+    void MessDatagram::TakeConEvents(vector<ConToken> *opened, vector<ConToken> *closed) {
+        opened->clear();
+        closed->clear();
+        opened->swap(evOpened);
+        closed->swap(evClosed);
+    }
+
+    namespace PackNlDelEx {
+
+        bool ReadyPacketPos(SegCursor *fpos) {
+            /* Update iterator only on success */
+            size_t posn;
+
+            if (!fpos->Find('\n', &posn))
+                return false;
+
+            fpos->Seek(posn + 1);
+            return true;
+        }
+
+        bool GetPacket(SegCursor *pos, Buf *out) {
+            const size_t start = pos->Pos();
+
+            if (!PackNlDelEx::ReadyPacketPos(pos))
+                return false;
+
+            pos->GetRange(start, pos->Pos(), out);
+            return true;
+        }
+
+    };
+
+    namespace PackLenEx {
+
+        bool FrameLen(const SegCursor &pos, uint32_t *len) {
+            uint32_t n;
+
+            if (!pos.Peek(pos.Pos(), PACKET_PART_SIZE_LEN, (char *)&n))
+                return false;
+
+            *len = ntohl(n);
+            return true;
+        }
+
+        bool GetPacket(SegCursor *pos, Buf *out) {
+            const size_t start = pos->Pos();
+            uint32_t len;
+
+            if (!FrameLen(*pos, &len) || pos->Size() - start - PACKET_PART_SIZE_LEN < len)
+                return false;
+
+            pos->GetRange(start + PACKET_PART_SIZE_LEN, start + PACKET_PART_SIZE_LEN + len, out);
+            pos->Seek(start + PACKET_PART_SIZE_LEN + len);
+            return true;
+        }
+
+        /* Payload checked in the same pass that copies it out, a bad packet is consumed with ok false */
+        bool GetPacketCrc(SegCursor *pos, Buf *out, bool *ok) {
+            const size_t start = pos->Pos();
+            uint32_t len, want;
+
+            if (!FrameLen(*pos, &len) || pos->Size() - start - PACKET_PART_SIZE_LEN < (size_t)len + sizeof want)
+                return false;
+
+            const size_t end = start + PACKET_PART_SIZE_LEN + len;
+            const uint32_t got = pos->GetRangeCrc(start + PACKET_PART_SIZE_LEN, end, out);
+            pos->Peek(end, sizeof want, (char *)&want);
+            pos->Seek(end + sizeof want);
+
+            *ok = got == ntohl(want);
+            return true;
+        }
+
+        void PutHeader(Buf *out, size_t len) {
+            const uint32_t n = htonl((uint32_t)len);
+            out->append((const char *)&n, PACKET_PART_SIZE_LEN);
+        }
+
+        /* For frames built in place: checksums out from payloadStart on */
+        void PutTrailer(Buf *out, size_t payloadStart) {
+            const uint32_t n = htonl(Crc32c::Update(0, out->data() + payloadStart, out->size() - payloadStart));
+            out->append((const char *)&n, sizeof n);
+        }
+
+        void Frame(Buf *out, const char *p, size_t n, bool crc) {
+            out->reserve(out->size() + PACKET_PART_SIZE_LEN + n + (crc ? 4 : 0));
+            PutHeader(out, n);
+            if (crc) {
+                const uint32_t c = htonl(Crc32c::Append(0, out, p, n));
+                out->append((const char *)&c, sizeof c);
+            } else {
+                out->append(p, n);
+            }
+        }
+
+    };
+
+    void PostProcess::Process() {
+        LOG(ERROR) << "Empty PostProcess step";
+        throw exception("Empty PostProcess step");
+    };
+
+    PostProcessFragmentWrite::PostProcessFragmentWrite(shared_ptr<deque<Fragment> > deq, const MessSock::StagedRead_t &sr) : deq(deq), sr(&sr) {}
+
+    void PostProcessFragmentWrite::Process() {
+        for (auto &i : sr->in) deq->push_back(i);
+    }
+
+    PostProcessCullPrefixAndMerge::PostProcessCullPrefixAndMerge(shared_ptr<deque<Fragment> > *in, const deque<Fragment> &extra, const PackContR cont) : in(in), extra(&extra), cont(cont) {}
+
+    void PostProcessCullPrefixAndMerge::Process() {
+        /* Everything consumed, drop (or don't create) the buffer */
+        if (!cont.inIn && cont.fragNo == extra->size()) {
+            in->reset();
+            return;
+        }
+
+        if (!*in) *in = make_shared<deque<Fragment> >();
+
+        deque<Fragment> &w = **in;
+
+        if (cont.inIn) {
+            NetData::Fragment::ErasePrefixTo(&w, PackCont(cont.fragNo, cont.partNo));
+            NetData::Fragment::CopySuffixFrom(*extra, PackCont(0, 0), &w);
+        } else {
+            w.clear();
+            NetData::Fragment::CopySuffixFrom(*extra, PackCont(cont.fragNo, cont.partNo), &w);
+        }
+
+        /* Keep the fragment count (and so the cost of every later scan) bounded by bytes, not segments received */
+        if (w.size() > COALESCE_FRAG_THRESHOLD)
+            NetData::Fragment::CoalesceSmall(&w, COALESCE_FRAG_SMALL, COALESCE_BLOCK_MAX);
+    }
+
+    PostProcessPackWrite::PostProcessPackWrite(shared_ptr<deque<Buf> > *dest, shared_ptr<deque<Buf> > src) : dest(dest), src(src) {}
+
+    void PostProcessPackWrite::Process() {
+        if (!*dest) *dest = make_shared<deque<Buf> >();
+        for (auto &i : *src) (*dest)->push_back(move(i));
+    }
+
+    PostProcessChunkWrite::PostProcessChunkWrite(shared_ptr<deque<PackChunk> > *dest, shared_ptr<deque<PackChunk> > src) : dest(dest), src(src) {}
+
+    void PostProcessChunkWrite::Process() {
+        if (!*dest) *dest = make_shared<deque<PackChunk> >();
+        for (auto &i : *src) (*dest)->push_back(move(i));
+    }
+
+    PostProcessStreamWrite::PostProcessStreamWrite(PackStream *dest, const PackStream &src) : dest(dest), src(src) {}
+
+    void PostProcessStreamWrite::Process() {
+        *dest = src;
+    }
+
+    PackChunk::PackChunk(PackPart part, Buf &&data) : part(part), data(move(data)) {}
+
+    PackStream::PackStream() : maxPacket(0), streaming(false), open(false), discarding(false), lenPrefix(false), left(0), crc(false), bad(0) {}
+
+    PackStream::PackStream(size_t maxPacket, bool streaming) : maxPacket(maxPacket), streaming(streaming), open(false), discarding(false), lenPrefix(false), left(0), crc(false), bad(0) {}
+
+    static const deque<Fragment> GNoFrags;
+
+    PipePacket::PipePacket() : in(), out(), inPack(), inStream(), stream() {}
+
+    void PipePacket::Reclaim() {
+        if (in && in->empty())             in.reset();
+        else if (in)                       in->shrink_to_fit();
+        if (out && out->empty())           out.reset();
+        else if (out)                      out->shrink_to_fit();
+        if (inPack && inPack->empty())     inPack.reset();
+        if (inStream && inStream->empty()) inStream.reset();
+    }
+
+    /* Nothing buffered and not inside a packet, the pipe can be dropped and recreated on next data */
+    bool PipePacket::DrainedP() const {
+        return (!in || in->empty()) && (!out || out->empty()) &&
+            (!inPack || inPack->empty()) && (!inStream || inStream->empty()) &&
+            !stream.open && !stream.discarding && !stream.left;
+    }
+
+    PipePacket * PipePacket::RemakeForRead(vector<shared_ptr<PostProcess> > *pp, const MessSock::StagedRead_t &sr) {
+        shared_ptr<deque<Buf> > inP = make_shared<deque<Buf> >();
+        shared_ptr<deque<PackChunk> > inS = make_shared<deque<PackChunk> >();
+        PackStream st = stream;
+
+        /* Check for completed packets, leave cursor past last completed packet */
+        SegCursor cont(in ? *in : GNoFrags, sr.in);
+
+        Buf data;
+        uint32_t len;
+        const size_t trailer = st.crc ? 4 : 0;
+        bool ok = true;
+        while (st.lenPrefix) {
+            /* Oversized packet, its length is known so the bytes are passed on (or skipped) as they arrive */
+            if (st.left) {
+                const size_t n = ZZMIN(st.left, cont.Size() - cont.Pos());
+                if (!n) break;
+
+                const size_t body = st.left > trailer ? st.left - trailer : 0;
+                const size_t k = ZZMIN(n, body);
+                if (st.streaming && k) {
+                    cont.GetRange(cont.Pos(), cont.Pos() + k, &data);
+                    const PackPart part = st.open ? (k == body ? PackPart::End : PackPart::Continue) : (k == body ? PackPart::Whole : PackPart::Begin);
+                    inS->push_back(PackChunk(part, move(data)));
+                    data = Buf();
+                    st.open = true;
+                }
+
+                cont.Seek(cont.Pos() + n);
+                st.left -= n;
+                if (st.left) break;
+
+                st.open = st.discarding = false;
+                continue;
+            }
+
+            if (!NetStuff::PackLenEx::FrameLen(cont, &len)) break;
+
+            if (st.maxPacket && len > st.maxPacket) {
+                if (!st.streaming) {
+                    LOG(WARNING) << "Dropping oversized packet " << sr.tok.id;
+                    st.discarding = true;
+                }
+                cont.Seek(cont.Pos() + PACKET_PART_SIZE_LEN);
+                st.left = len + trailer;
+                continue;
+            }
+
+            if (st.crc ? !NetStuff::PackLenEx::GetPacketCrc(&cont, &data, &ok) : !NetStuff::PackLenEx::GetPacket(&cont, &data)) break;
+
+            if (!ok) {
+                LOG(WARNING) << "Dropping packet with bad CRC " << sr.tok.id;
+                st.bad++;
+                data = Buf();
+                continue;
+            }
+
+            if (st.streaming) inS->push_back(PackChunk(PackPart::Whole, move(data)));
+            else              inP->push_back(move(data));
+            data = Buf();
+        }
+
+        while (!st.lenPrefix && NetStuff::PackNlDelEx::GetPacket(&cont, &data)) {
+            if (st.open)                                        { inS->push_back(PackChunk(PackPart::End, move(data))); st.open = false; }
+            else if (st.discarding)                             { st.discarding = false; }
+            else if (st.streaming)                              { inS->push_back(PackChunk(PackPart::Whole, move(data))); }
+            else if (st.maxPacket && data.size() > st.maxPacket) { LOG(WARNING) << "Dropping oversized packet " << sr.tok.id; }
+            else                                                { inP->push_back(move(data)); }
+            data = Buf();
+        }
+
+        /* Incomplete packet over the limit: hand off (or drop) what arrived so far instead of buffering it */
+        if (st.maxPacket && !st.lenPrefix) {
+            if (cont.Size() - cont.Pos() > st.maxPacket) {
+                if (st.streaming) {
+                    cont.GetRange(cont.Pos(), cont.Size(), &data);
+                    inS->push_back(PackChunk(st.open ? PackPart::Continue : PackPart::Begin, move(data)));
+                    st.open = true;
+                } else if (!st.discarding) {
+                    LOG(WARNING) << "Dropping oversized packet " << sr.tok.id;
+                    st.discarding = true;
+                }
+
+                cont.Seek(cont.Size());
+            }
+        }
+
+        const PackContR finalCont = cont.ContR(in ? in->size() : 0);
+
+        pp->push_back(make_shared<PostProcessCullPrefixAndMerge>(&in, sr.in, finalCont));
+        if (!inP->empty()) pp->push_back(make_shared<PostProcessPackWrite>(&inPack, inP));
+        if (!inS->empty()) pp->push_back(make_shared<PostProcessChunkWrite>(&inStream, inS));
+        pp->push_back(make_shared<PostProcessStreamWrite>(&stream, st));
+
+        return this;
+    }
+
+    shared_ptr<Pipe> PipeMaker::MakePacket() {
+        return PipeMaker::MakePacket(PackStream());
+    }
+
+    shared_ptr<Pipe> PipeMaker::MakePacket(const PackStream &ps) {
+        auto p = make_shared<Pipe>();
+        auto r = PipeMaker::MakePacketR(ps);
+        p->pr = r;
+        return p;
+    }
+
+    shared_ptr<PipePacket> PipeMaker::MakePacketR(const PackStream &ps) {
+        shared_ptr<PipePacket> pl = make_shared<PipePacket>();
+        pl->pt = PipeType::Packet;
+        pl->stream = ps;
+        return pl;
+    }
+
+    shared_ptr<PipePacket> PipeMaker::CastPacket(shared_ptr<PipeR> w) {
+        assert(w->pt == PipeType::Packet);
+        auto q = dynamic_pointer_cast<PipePacket>(w);
+        if (!q) throw bad_cast();
+        return q;
+    }
+
+    Pipe::Pipe() : pr(), lastActive(0) {}
+
+    /* Whole packets plus streamed chunks */
+    static size_t PackDepth(const Pipe *p) {
+        if (!p) return 0;
+        const auto w = PipeMaker::CastPacket(p->pr);
+        return (w->inPack ? w->inPack->size() : 0) + (w->inStream ? w->inStream->size() : 0);
+    }
+
+    PipeSet::Popped_t::Popped_t(ConToken tok, Buf &&data) : tok(tok), data(move(data)) {}
+
+    PipeSet::PoppedChunk_t::PoppedChunk_t(ConToken tok, PackChunk &&chunk) : tok(tok), part(chunk.part), data(move(chunk.data)) {}
+
+    PipeSet::PipeSet() : popNext(0), chunkNext(0), queued(0), pipes(), packStream(), tick(0) {}
+
+    void PipeSet::MergePacketed(const vector<ConToken> &toks) {
+        set<ConToken, ConTokenLess> ptoks, mtoks;
+        for (auto &i : pipes) ptoks.insert(i.first);
+        for (auto &i : toks) mtoks.insert(i);
+
+        vector<ConToken> toCreate;
+        set_difference(mtoks.begin(), mtoks.end(), ptoks.begin(), ptoks.end(), back_inserter(toCreate), ConTokenLess());
+
+        /* Pipes themselves are created on first data */
+        for (auto &i : toCreate) assert(pipes.find(i) == pipes.end());
+        for (auto &i : toCreate) pipes[i] = shared_ptr<Pipe>();
+        for (auto &i : toCreate) LOG(INFO) << "Creating Packet Pipe " << i.id;
+    }
+
+    /* Chained connections must go through the pointer overload, this one would skip their stages */
+    void PipeSet::RemakeForRead(const vector<MessSock::StagedRead_t> &sockReads) {
+        for (auto &i : sockReads) assert(chains.find(i.tok) == chains.end());
+        RemakeFramed(sockReads);
+    }
+
+    void PipeSet::RemakeFramed(const vector<MessSock::StagedRead_t> &sockReads) {
+        vector<shared_ptr<PostProcess> > pc;
+        vector<Pipe *> touched;
+        vector<ConToken> touchedToks;
+
+        tick++;
+
+        for (auto &i : sockReads) {
+            auto it = pipes.find(i.tok);
+            if (it == pipes.end()) { LOG(ERROR) << "Read of inexistant " << i.tok.id; continue; }
+            if (!it->second) it->second = PipeMaker::MakePacket(packStream);
+            it->second->pr->RemakeForRead(&pc, i);
+            it->second->lastActive = tick;
+            touched.push_back(it->second.get());
+            touchedToks.push_back(i.tok);
+        }
+
+        for (auto &i : touched) queued -= PackDepth(i);
+        for (auto &i : pc) i->Process();
+        for (auto &i : touched) queued += PackDepth(i);
+
+        for (size_t i = 0; i < touched.size(); i++) {
+            PackStream &st = PipeMaker::CastPacket(touched[i]->pr)->stream;
+            for (; st.bad; st.bad--) badToks.push_back(touchedToks[i]);
+        }
+    }
+
+    /* Runs each connection's stage chain over its read, then frames as usual */
+    void PipeSet::RemakeForRead(vector<MessSock::StagedRead_t> *sockReads) {
+        if (!chains.empty()) {
+            for (auto &i : *sockReads) {
+                auto it = chains.find(i.tok);
+                if (it != chains.end()) it->second->Run(&i);
+            }
+        }
+
+        RemakeFramed(*sockReads);
+    }
+
+    void PipeSet::SetChain(const vector<ConToken> &toks, shared_ptr<StageChain> chain) {
+        for (auto &i : toks) {
+            if (chain) chains[i] = chain;
+            else       chains.erase(i);
+        }
+    }
+
+    /* Connections that sent packets failing their CRC since the last call, one entry per packet */
+    size_t PipeSet::TakeBadPackets(vector<ConToken> *out) {
+        const size_t n = badToks.size();
+        out->insert(out->end(), badToks.begin(), badToks.end());
+        badToks.clear();
+        return n;
+    }
+
+    size_t PipeSet::PopFrom(const ConToken &tok, Pipe *p, vector<Popped_t> *out, size_t maxN) {
+        deque<Buf> *w = PipeMaker::CastPacket(p->pr)->inPack.get();
+        size_t n = 0;
+
+        for (; w && n < maxN && !w->empty(); n++) {
+            out->push_back(Popped_t(tok, move(w->front())));
+            w->pop_front();
+        }
+
+        queued -= n;
+        return n;
+    }
+
+    /* Appends up to maxN packets to out, oldest first per connection. Connections are visited
+       round robin, each call resuming after the last one served. Storage handed out is pooled,
+       destroying (or reusing) the Bufs returns it. */
+    size_t PipeSet::PopPackets(vector<Popped_t> *out, size_t maxN) {
+        size_t n = 0;
+        auto it = pipes.lower_bound(ConToken(popNext));
+
+        for (size_t k = 0; k < pipes.size() && n < maxN && queued; k++, ++it) {
+            if (it == pipes.end()) it = pipes.begin();
+            if (it->second) n += PopFrom(it->first, it->second.get(), out, maxN - n);
+        }
+
+        popNext = it == pipes.end() ? 0 : it->first.id;
+        return n;
+    }
+
+    size_t PipeSet::PopPackets(const ConToken &tok, vector<Popped_t> *out, size_t maxN) {
+        auto it = pipes.find(tok);
+        if (it == pipes.end() || !it->second) return 0;
+        return PopFrom(it->first, it->second.get(), out, maxN);
+    }
+
+    size_t PipeSet::PopChunksFrom(const ConToken &tok, Pipe *p, vector<PoppedChunk_t> *out, size_t maxN) {
+        deque<PackChunk> *w = PipeMaker::CastPacket(p->pr)->inStream.get();
+        size_t n = 0;
+
+        for (; w && n < maxN && !w->empty(); n++) {
+            out->push_back(PoppedChunk_t(tok, move(w->front())));
+            w->pop_front();
+        }
+
+        queued -= n;
+        return n;
+    }
+
+    /* PopPackets for streaming pipes (see PackStream): chunks in arrival order per connection,
+       connections round robin with a cursor of their own */
+    size_t PipeSet::PopChunks(vector<PoppedChunk_t> *out, size_t maxN) {
+        size_t n = 0;
+        auto it = pipes.lower_bound(ConToken(chunkNext));
+
+        for (size_t k = 0; k < pipes.size() && n < maxN && queued; k++, ++it) {
+            if (it == pipes.end()) it = pipes.begin();
+            if (it->second) n += PopChunksFrom(it->first, it->second.get(), out, maxN - n);
+        }
+
+        chunkNext = it == pipes.end() ? 0 : it->first.id;
+        return n;
+    }
+
+    size_t PipeSet::PopChunks(const ConToken &tok, vector<PoppedChunk_t> *out, size_t maxN) {
+        auto it = pipes.find(tok);
+        if (it == pipes.end() || !it->second) return 0;
+        return PopChunksFrom(it->first, it->second.get(), out, maxN);
+    }
+
+    /* Packets (and streamed chunks) parsed and not yet popped, across all connections */
+    size_t PipeSet::QueueDepth() const {
+        return queued;
+    }
+
+    size_t PipeSet::QueueDepth(const ConToken &tok) const {
+        auto it = pipes.find(tok);
+        return it == pipes.end() ? 0 : PackDepth(it->second.get());
+    }
+
+    /* Applies only what changed since the last call (see MessSock::TakeConEvents), closes first.
+       Packets still queued on a closed connection's pipe are dropped with it. */
+    void PipeSet::MergeConEvents(const vector<ConToken> &opened, const vector<ConToken> &closed) {
+        for (auto &i : closed) {
+            chains.erase(i);
+            auto it = pipes.find(i);
+            if (it == pipes.end()) continue;
+            queued -= PackDepth(it->second.get());
+            pipes.erase(it);
+        }
+
+        /* An adopted pipe (see Adopt) is kept */
+        for (auto &i : opened)
+            pipes.insert(make_pair(i, shared_ptr<Pipe>()));
+    }
+
+    shared_ptr<Pipe> PipeSet::Detach(const ConToken &tok) {
+        shared_ptr<Pipe> ret;
+        auto it = pipes.find(tok);
+        if (it == pipes.end()) return ret;
+
+        ret = it->second;
+        queued -= PackDepth(ret.get());
+        pipes.erase(it);
+        return ret;
+    }
+
+    void PipeSet::Adopt(const ConToken &tok, shared_ptr<Pipe> pipe) {
+        queued -= PackDepth(pipes[tok].get());
+        queued += PackDepth(pipe.get());
+        if (pipe) pipe->lastActive = tick;
+        pipes[tok] = pipe;
+    }
+
+    static void PutU32(string *dst, uint32_t v) {
+        dst->append((const char *)&v, sizeof v);
+    }
+
+    static void PutBytes(string *dst, const char *p, size_t n) {
+        PutU32(dst, (uint32_t)n);
+        dst->append(p, n);
+    }
+
+    static void PutFrags(string *dst, const deque<Fragment> *d) {
+        size_t n = 0;
+        if (d) for (auto &i : *d) n += i.data.size();
+
+        PutU32(dst, (uint32_t)n);
+        if (d) for (auto &i : *d) dst->append(i.data.data(), i.data.size());
+    }
+
+    static uint32_t GetU32(const string &src, size_t *pos) {
+        uint32_t v;
+        if (src.size() - *pos < sizeof v) throw exception("Handoff state");
+        memcpy(&v, src.data() + *pos, sizeof v);
+        *pos += sizeof v;
+        return v;
+    }
+
+    static Buf GetBytes(const string &src, size_t *pos) {
+        const uint32_t n = GetU32(src, pos);
+        if (src.size() - *pos < n) throw exception("Handoff state");
+        Buf ret(src.data() + *pos, n);
+        *pos += n;
+        return ret;
+    }
+
+    /* Fragment boundaries are not preserved, each side's bytes travel as one run */
+    static void SaveCon(string *dst, const ConToken &tok, const deque<Fragment> &sockOut, const shared_ptr<Pipe> &pipe) {
+        PutU32(dst, HOT_RESTART_MAGIC);
+        PutU32(dst, tok.id);
+        PutFrags(dst, &sockOut);
+        PutU32(dst, pipe ? 1 : 0);
+        if (!pipe) return;
+
+        const auto w = PipeMaker::CastPacket(pipe->pr);
+
+        PutU32(dst, (uint32_t)w->stream.maxPacket);
+        PutU32(dst, (w->stream.streaming ? 1 : 0) | (w->stream.open ? 2 : 0) | (w->stream.discarding ? 4 : 0) | (w->stream.lenPrefix ? 8 : 0) | (w->stream.crc ? 16 : 0));
+        PutU32(dst, (uint32_t)w->stream.left);
+        PutFrags(dst, w->in.get());
+        PutFrags(dst, w->out.get());
+
+        PutU32(dst, w->inPack ? (uint32_t)w->inPack->size() : 0);
+        if (w->inPack) for (auto &i : *w->inPack) PutBytes(dst, i.data(), i.size());
+
+        PutU32(dst, w->inStream ? (uint32_t)w->inStream->size() : 0);
+        if (w->inStream) for (auto &i : *w->inStream) { PutU32(dst, (uint32_t)i.part); PutBytes(dst, i.data.data(), i.data.size()); }
+    }
+
+    static shared_ptr<Pipe> LoadCon(const string &src, ConToken *tok, deque<Fragment> *sockOut) {
+        size_t pos = 0;
+        shared_ptr<Pipe> ret;
+
+        if (GetU32(src, &pos) != HOT_RESTART_MAGIC) throw exception("Handoff state");
+        tok->id = GetU32(src, &pos);
+        Buf so = GetBytes(src, &pos);
+        if (!so.empty()) sockOut->push_back(Fragment(EmptyStamp(), move(so)));
+        if (!GetU32(src, &pos)) return ret;
+
+        PackStream st(GetU32(src, &pos), false);
+        const uint32_t flags = GetU32(src, &pos);
+        st.streaming = (flags & 1) != 0;
+        st.open = (flags & 2) != 0;
+        st.discarding = (flags & 4) != 0;
+        st.lenPrefix = (flags & 8) != 0;
+        st.crc = (flags & 16) != 0;
+        st.left = GetU32(src, &pos);
+
+        ret = PipeMaker::MakePacket(st);
+        const auto w = PipeMaker::CastPacket(ret->pr);
+
+        Buf in = GetBytes(src, &pos), out = GetBytes(src, &pos);
+        if (!in.empty())  { w->in = make_shared<deque<Fragment> >();  w->in->push_back(Fragment(EmptyStamp(), move(in))); }
+        if (!out.empty()) { w->out = make_shared<deque<Fragment> >(); w->out->push_back(Fragment(EmptyStamp(), move(out))); }
+
+        for (uint32_t n = GetU32(src, &pos); n; n--) {
+            if (!w->inPack) w->inPack = make_shared<deque<Buf> >();
+            w->inPack->push_back(GetBytes(src, &pos));
+        }
+
+        for (uint32_t n = GetU32(src, &pos); n; n--) {
+            if (!w->inStream) w->inStream = make_shared<deque<PackChunk> >();
+            const PackPart part = (PackPart)GetU32(src, &pos);
+            w->inStream->push_back(PackChunk(part, GetBytes(src, &pos)));
+        }
+
+        return ret;
+    }
+
+    HashRing::HashRing() : points(), vnodes(HASH_RING_VNODES) {}
+
+    /* FNV-1a with a murmur3 finalizer, FNV alone clusters short similar keys */
+    uint32_t HashRing::Hash(const char *p, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) { h ^= (uint8_t)p[i]; h *= 16777619u; }
+
+        h ^= h >> 16; h *= 0x85ebca6bu;
+        h ^= h >> 13; h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    void HashRing::Add(uint32_t worker) {
+        for (uint32_t i = 0; i < vnodes; i++) {
+            const uint32_t k[2] = { worker, i };
+            points.insert(make_pair(Hash((const char *)k, sizeof k), worker));
+        }
+    }
+
+    void HashRing::Remove(uint32_t worker) {
+        for (auto it = points.begin(); it != points.end();)
+            if (it->second == worker) it = points.erase(it);
+            else                      ++it;
+    }
+
+    /* First point at or after h, wrapping around */
+    bool HashRing::Lookup(uint32_t h, uint32_t *worker) const {
+        if (points.empty()) return false;
+        auto it = points.lower_bound(h);
+        if (it == points.end()) it = points.begin();
+        *worker = it->second;
+        return true;
+    }
+
+    bool HashRing::Empty() const {
+        return points.empty();
+    }
+
+    ClusterFront::ClusterFront() : ring(), workers(), keyHash(&ClusterFront::LeadingFieldHash) {}
+
+    /* Either transport may be null, a worker then takes only connections or only packets */
+    void ClusterFront::AddWorker(uint32_t id, shared_ptr<HandoffChannel> ch, shared_ptr<PrimitiveBase> pkt) {
+        Worker &w = workers[id];
+        w.ch = ch;
+        w.pkt = pkt;
+        ring.Add(id);
+    }
+
+    /* Packets still pending for it are dropped */
+    void ClusterFront::RemoveWorker(uint32_t id) {
+        ring.Remove(id);
+        workers.erase(id);
+    }
+
+    /* Hands each accepted connection to the worker owning its peer address. A connection nobody can take
+       (no workers, or the worker's channel not yet introduced) is closed. */
+    size_t ClusterFront::Dispatch(const vector<PollFdType> &accepted) {
+        size_t n = 0;
+
+        for (auto &i : accepted) {
+            sockaddr_storage peer;
+            int peerLen = sizeof peer;
+            uint32_t id;
+
+            if (getpeername(i.s, (sockaddr *)&peer, &peerLen) == SOCKET_ERROR) peerLen = 0;
+
+            auto it = ring.Lookup(HashRing::Hash((const char *)&peer, peerLen), &id) ? workers.find(id) : workers.end();
+            if (it == workers.end() || !it->second.ch || !it->second.ch->PeerKnown()) {
+                LOG(WARNING) << "No worker for accepted connection";
+                closesocket(i.s);
+                continue;
+            }
+
+            /* A broken channel costs only this connection, the rest of the batch is still handed out */
+            try {
+                it->second.ch->Send(i.s, string());
+            } catch (...) {
+                LOG(WARNING) << "Handoff to worker " << id << " failed";
+                closesocket(i.s);
+                continue;
+            }
+            n++;
+        }
+
+        return n;
+    }
+
+    /* Moves packets onto their worker's queue (see Flush), the ones no worker can take stay in packets */
+    size_t ClusterFront::Route(vector<PipeSet::Popped_t> *packets) {
+        size_t n = 0, kept = 0;
+
+        for (size_t i = 0; i < packets->size(); i++) {
+            PipeSet::Popped_t &p = (*packets)[i];
+            uint32_t id;
+
+            auto it = ring.Lookup(keyHash(p.data), &id) ? workers.find(id) : workers.end();
+            if (it == workers.end() || !it->second.pkt) {
+                if (kept != i) {
+                    (*packets)[kept].tok = p.tok;
+                    (*packets)[kept].data.swap(p.data);
+                }
+                kept++;
+                continue;
+            }
+
+            it->second.pending.push_back(Fragment(EmptyStamp(), move(p.data)));
+            n++;
+        }
+
+        packets->erase(packets->begin() + kept, packets->end());
+        return n;
+    }
+
+    /* Writes queued packets, a full worker transport keeps the rest queued. Returns the workers still backed up. */
+    size_t ClusterFront::Flush() {
+        size_t backed = 0;
+
+        for (auto &i : workers) {
+            if (i.second.pending.empty()) continue;
+
+            try {
+                i.second.pkt->WriteU(&i.second.pending);
+            } catch (NetBlockExc &e) {
+                backed++;
+            } catch (NetFailureExc &e) {
+                LOG(WARNING) << "Worker " << i.first << " packet transport gone, dropping its queue";
+                i.second.pending.clear();
+            }
+        }
+
+        return backed;
+    }
+
+    /* Handshakes and handover acknowledgements on the worker channels. A worker whose channel
+       went away leaves the ring, its share of new connections and packets moves to the others. */
+    void ClusterFront::Pump() {
+        vector<HandoffChannel::Handoff_t> none;
+        vector<uint32_t> gone;
+
+        for (auto &i : workers) {
+            if (!i.second.ch) continue;
+
+            try {
+                i.second.ch->Recv(&none);
+            } catch (NetFailureExc &e) {
+                LOG(WARNING) << "Worker " << i.first << " channel gone";
+                gone.push_back(i.first);
+            }
+        }
+
+        for (auto &i : gone) RemoveWorker(i);
+        for (auto &i : none) closesocket(i.pfd.s);
+    }
+
+    /* Key is the packet up to its first space (or delimiter) */
+    uint32_t ClusterFront::LeadingFieldHash(const Buf &packet) {
+        size_t n = 0;
+        while (n < packet.size() && packet[n] != ' ' && packet[n] != '\n') n++;
+        return HashRing::Hash(packet.data(), n);
+    }
+
+    /* Lookups never add buckets, topic names come from peers */
+    TopicRouter::Topic * TopicRouter::Find(const char *name, size_t len, bool create) {
+        const uint32_t h = HashRing::Hash(name, len);
+        auto it = topics.find(h);
+
+        if (it != topics.end())
+            for (auto &i : it->second)
+                if (i.name.size() == len && !memcmp(i.name.data(), name, len)) return &i;
+
+        if (!create) return nullptr;
+
+        vector<Topic> &b = it != topics.end() ? it->second : topics[h];
+        Topic t;
+        t.name.assign(name, len);
+        b.push_back(t);
+        return &b.back();
+    }
+
+    void TopicRouter::Subscribe(const string &topic, const ConToken &tok) {
+        Topic *t = Find(topic.data(), topic.size(), true);
+
+        for (auto &i : t->subs) if (i.id == tok.id) return;
+
+        t->subs.push_back(tok);
+        subsOf[tok].push_back(topic);
+    }
+
+    /* Order of the remaining subscribers is not kept. A topic goes away with its last subscriber. */
+    void TopicRouter::Unsubscribe(const string &topic, const ConToken &tok) {
+        Topic *t = Find(topic.data(), topic.size(), false);
+        if (!t) return;
+
+        for (size_t i = 0; i < t->subs.size(); i++) {
+            if (t->subs[i].id != tok.id) continue;
+            t->subs[i] = t->subs.back();
+            t->subs.pop_back();
+            break;
+        }
+
+        if (t->subs.empty()) {
+            auto bit = topics.find(HashRing::Hash(topic.data(), topic.size()));
+            vector<Topic> &b = bit->second;
+            b.erase(b.begin() + (t - &b[0]));
+            if (b.empty()) topics.erase(bit);
+        }
+
+        auto it = subsOf.find(tok);
+        if (it == subsOf.end()) return;
+        auto &v = it->second;
+        v.erase(remove(v.begin(), v.end(), topic), v.end());
+        if (v.empty()) subsOf.erase(it);
+    }
+
+    /* Closed connections leave every topic they were on */
+    void TopicRouter::Drop(const vector<ConToken> &closed) {
+        for (auto &tok : closed) {
+            auto it = subsOf.find(tok);
+            if (it == subsOf.end()) continue;
+
+            const vector<string> names(it->second);
+            for (auto &i : names) Unsubscribe(i, tok);
+        }
+    }
+
+    size_t TopicRouter::Subscribers(const string &topic) {
+        Topic *t = Find(topic.data(), topic.size(), false);
+        return t ? t->subs.size() : 0;
+    }
+
+    /* Hash buckets held, each one with at least one subscribed topic */
+    size_t TopicRouter::Topics() const {
+        return topics.size();
+    }
+
+    /* Consumes packets, returns deliveries queued. A packet nobody subscribed to is dropped. */
+    size_t TopicRouter::Route(MessSock *m, vector<PipeSet::Popped_t> *packets) {
+        size_t n = 0;
+
+        for (auto &p : *packets) {
+            const Buf &d = p.data;
+            size_t len = 0;
+            while (len < d.size() && d[len] != ' ' && d[len] != '\n' && d[len] != '\r') len++;
+
+            if (len > 1 && (d[0] == '+' || d[0] == '-')) {
+                const string topic(d.data() + 1, len - 1);
+                if (d[0] == '+') Subscribe(topic, p.tok);
+                else             Unsubscribe(topic, p.tok);
+                continue;
+            }
+
+            Topic *t = Find(d.data(), len, false);
+            if (!t || t->subs.empty()) continue;
+
+            n += m->Broadcast(t->subs, make_shared<Buf>(move(p.data)));
+        }
+
+        packets->clear();
+        return n;
+    }
+
+    RpcEndpoint::Request_t::Request_t(ConToken tok, uint32_t id, Buf &&body) : tok(tok), id(id), body(move(body)) {}
+
+    RpcEndpoint::Completion_t::Completion_t(ConToken tok, uint32_t id, Status status, Buf &&body) : tok(tok), id(id), status(status), body(move(body)) {}
+
+    RpcEndpoint::Slot::Slot() : tok(0), deadline(0), gen(0), used(false) {}
+
+    RpcEndpoint::RpcEndpoint() : slots(), freeSlots(), inFlight(0) {}
+
+    static void RpcFrame(Buf *out, char kind, uint32_t id, const char *body, size_t len) {
+        const uint32_t nid = htonl(id);
+        out->reserve(PACKET_PART_SIZE_LEN + RPC_HDR_LEN + len);
+        PackLenEx::PutHeader(out, RPC_HDR_LEN + len);
+        out->push_back(kind);
+        out->append((const char *)&nid, sizeof nid);
+        out->append(body, len);
+    }
+
+    /* Returns the correlation id, the call completes through Dispatch, Expire or Drop.
+       Throws, with the slot released, when the connection refuses the request. */
+    uint32_t RpcEndpoint::Call(MessSock *m, const ConToken &tok, const char *body, size_t len, uint32_t deadline) {
+        if (freeSlots.empty()) {
+            if (slots.size() == RPC_SLOTS_MAX) throw exception("Too many calls in flight");
+            freeSlots.push_back((uint32_t)slots.size());
+            slots.resize(slots.size() + 1);
+        }
+
+        const uint32_t idx = freeSlots.back();
+        freeSlots.pop_back();
+
+        Slot &s = slots[idx];
+        s.tok = tok;
+        s.deadline = deadline;
+        s.used = true;
+        inFlight++;
+
+        const uint32_t id = ((uint32_t)s.gen << 16) | idx;
+
+        Buf b;
+        RpcFrame(&b, RPC_KIND_REQUEST, id, body, len);
+        if (!m->Send(tok, move(b))) {
+            s.used = false;
+            freeSlots.push_back(idx);
+            inFlight--;
+            throw exception("Call send");
+        }
+
+        return id;
+    }
+
+    /* False when the connection refuses the reply (see MessSock::Send) */
+    bool RpcEndpoint::Reply(MessSock *m, const ConToken &tok, uint32_t id, const char *body, size_t len) {
+        Buf b;
+        RpcFrame(&b, RPC_KIND_REPLY, id, body, len);
+        return m->Send(tok, move(b));
+    }
+
+    void RpcEndpoint::Finish(uint32_t slot, Status status, Buf &&body, vector<Completion_t> *done) {
+        Slot &s = slots[slot];
+        done->push_back(Completion_t(s.tok, ((uint32_t)s.gen << 16) | slot, status, move(body)));
+
+        s.used = false;
+        s.gen++;
+        freeSlots.push_back(slot);
+        inFlight--;
+    }
+
+    /* Consumes packets: requests are passed on for the caller to Reply to, replies complete their calls */
+    size_t RpcEndpoint::Dispatch(vector<PipeSet::Popped_t> *packets, vector<Request_t> *requests, vector<Completion_t> *done) {
+        size_t n = 0;
+
+        for (auto &p : *packets) {
+            if (p.data.size() < RPC_HDR_LEN) {
+                LOG(WARNING) << "Short RPC message " << p.tok.id;
+                continue;
+            }
+
+            const char kind = p.data[0];
+            uint32_t id;
+            memcpy(&id, p.data.data() + 1, sizeof id);
+            id = ntohl(id);
+            p.data.erase(0, RPC_HDR_LEN);
+
+            if (kind == RPC_KIND_REQUEST) {
+                requests->push_back(Request_t(p.tok, id, move(p.data)));
+                n++;
+                continue;
+            }
+
+            const uint32_t idx = id & 0xffff;
+            if (kind != RPC_KIND_REPLY || idx >= slots.size()) continue;
+
+            /* Expired, or the slot went to another call since */
+            const Slot &s = slots[idx];
+            if (!s.used || s.gen != (id >> 16) || s.tok.id != p.tok.id) continue;
+
+            Finish(idx, Status::Ok, move(p.data), done);
+            n++;
+        }
+
+        packets->clear();
+        return n;
+    }
+
+    size_t RpcEndpoint::Expire(uint32_t now, vector<Completion_t> *done) {
+        size_t n = 0;
 
-        if (!numCons) return ret;
+        for (uint32_t i = 0; i < slots.size() && inFlight; i++) {
+            const Slot &s = slots[i];
+            if (!s.used || !s.deadline || (int32_t)(now - s.deadline) < 0) continue;
+            Finish(i, Status::Timeout, Buf(), done);
+            n++;
+        }
 
-        aux.RebuildPollFrom(GetPollFds());
+        return n;
+    }
 
-        vector<bool> pollres = aux.PerformPoll();
+    size_t RpcEndpoint::Drop(const vector<ConToken> &closed, vector<Completion_t> *done) {
+        set<ConToken, ConTokenLess> c(closed.begin(), closed.end());
+        size_t n = 0;
 
-        size_t idx = 0;
+        for (uint32_t i = 0; i < slots.size() && inFlight; i++) {
+            if (!slots[i].used || c.find(slots[i].tok) == c.end()) continue;
+            Finish(i, Status::Closed, Buf(), done);
+            n++;
+        }
 
-        for (auto &it : cons) {
-            if (!pollres[idx++]) continue;
+        return n;
+    }
 
-            deque<Fragment> w;
+    size_t RpcEndpoint::InFlight() const {
+        return inFlight;
+    }
 
-            try {
-                GNetNat.PollFdTypeRead(it.second.pfd, &w);
-            } catch (NetBlockExc &e) {
-                /* Nothing */
-            } catch (NetDisconnectExc &e) {
-                StagedDisc_t mgde = { it.first, true };
-                ret.d->push_back(mgde);
-            } catch (NetFailureExc &e) {
-                StagedDisc_t mgde = { it.first, false };
-                ret.d->push_back(mgde);
+    StreamMux::Data_t::Data_t(ConToken tok, uint32_t stream, Buf &&data) : tok(tok), stream(stream), data(move(data)) {}
+
+    StreamMux::Stream::Stream() : sendWin(0), recvWin(0), grant(0), out(), outOff(0), listed(false), closing(false), peer(false) {}
+
+    StreamMux::Con::Con() : streams(), ready(), grants(), closes(), peerStreams(0) {}
+
+    StreamMux::StreamMux() : cons(), window(MUX_WINDOW_DEFAULT), frameMax(MUX_FRAME_MAX), maxStreams(MUX_STREAMS_MAX) {}
+
+    StreamMux::Stream & StreamMux::Get(Con &c, uint32_t stream) {
+        auto it = c.streams.find(stream);
+        if (it != c.streams.end()) return it->second;
+
+        Stream &st = c.streams[stream];
+        st.sendWin = st.recvWin = window;
+        return st;
+    }
+
+    void StreamMux::List(Con &c, uint32_t stream, Stream &st) {
+        if (st.listed || st.out.empty() || !st.sendWin) return;
+        st.listed = true;
+        c.ready.push_back(stream);
+    }
+
+    void StreamMux::Erase(Con &c, uint32_t stream) {
+        auto it = c.streams.find(stream);
+        if (it == c.streams.end()) return;
+        if (it->second.peer) c.peerStreams--;
+        c.streams.erase(it);
+
+        c.ready.erase(remove(c.ready.begin(), c.ready.end(), stream), c.ready.end());
+        c.grants.erase(remove(c.grants.begin(), c.grants.end(), stream), c.grants.end());
+    }
+
+    static void MuxFrame(Buf *out, char kind, uint32_t stream, const char *data, size_t len) {
+        const uint32_t ns = htonl(stream);
+        out->reserve(PACKET_PART_SIZE_LEN + MUX_HDR_LEN + len);
+        PackLenEx::PutHeader(out, MUX_HDR_LEN + len);
+        out->push_back(kind);
+        out->append((const char *)&ns, sizeof ns);
+        out->append(data, len);
+    }
+
+    void StreamMux::Write(const ConToken &tok, uint32_t stream, const char *data, size_t len) {
+        if (!len) return;
+        Con &c = cons[tok];
+        Stream &st = Get(c, stream);
+        if (st.closing) throw exception("Write to closed stream");
+        st.out.push_back(Buf(data, len));
+        List(c, stream, st);
+    }
+
+    /* The close frame follows the stream's queued output, both ends forget the stream once it is sent / received */
+    void StreamMux::Close(const ConToken &tok, uint32_t stream) {
+        auto it = cons.find(tok);
+        if (it == cons.end()) return;
+        Con &c = it->second;
+        auto sit = c.streams.find(stream);
+        if (sit == c.streams.end() || sit->second.closing) return;
+
+        sit->second.closing = true;
+        if (sit->second.out.empty()) c.closes.push_back(stream);
+    }
+
+    /* The application took n bytes of the stream, the peer may send that much more */
+    void StreamMux::Consumed(const ConToken &tok, uint32_t stream, size_t n) {
+        Con &c = cons[tok];
+        Stream &st = Get(c, stream);
+        if (!n) return;
+        if (n > UINT32_MAX - st.recvWin) throw exception("Consumed past the window");
+        if (!st.grant) c.grants.push_back(stream);
+        st.grant += (uint32_t)n;
+        st.recvWin += (uint32_t)n;
+    }
+
+    size_t StreamMux::Pending(const ConToken &tok, uint32_t stream) const {
+        auto it = cons.find(tok);
+        if (it == cons.end()) return 0;
+        auto sit = it->second.streams.find(stream);
+        if (sit == it->second.streams.end()) return 0;
+
+        size_t n = 0;
+        for (auto &i : sit->second.out) n += i.size();
+        return n - sit->second.outOff;
+    }
+
+    /* Consumes packets, stream data goes to out in arrival order. An empty Data_t marks the peer closing
+       the stream. Only data opens a stream from the peer's side, at most maxStreams of them per connection. */
+    size_t StreamMux::Dispatch(vector<PipeSet::Popped_t> *packets, vector<Data_t> *out) {
+        size_t n = 0;
+
+        for (auto &p : *packets) {
+            if (p.data.size() < MUX_HDR_LEN) {
+                LOG(WARNING) << "Short stream frame " << p.tok.id;
+                continue;
             }
 
-            /* Might have read something even if a disconnect or failure occurred */
-            if (!w.empty()) {
-                StagedRead_t mgre = { it.first, w };
-                ret.r->push_back(mgre);
+            const char kind = p.data[0];
+            uint32_t stream;
+            memcpy(&stream, p.data.data() + 1, sizeof stream);
+            stream = ntohl(stream);
+
+            Con &c = cons[p.tok];
+            auto it = c.streams.find(stream);
+
+            if (kind == MUX_KIND_CLOSE) {
+                if (it == c.streams.end()) continue;
+                Erase(c, stream);
+                out->push_back(Data_t(p.tok, stream, Buf()));
+                n++;
+                continue;
+            }
+
+            if (kind == MUX_KIND_WINDOW && p.data.size() == MUX_HDR_LEN + 4) {
+                if (it == c.streams.end()) continue;
+                Stream &st = it->second;
+                uint32_t inc;
+                memcpy(&inc, p.data.data() + MUX_HDR_LEN, sizeof inc);
+                inc = ntohl(inc);
+                if (inc > UINT32_MAX - st.sendWin) {
+                    LOG(WARNING) << "Stream window overflow " << p.tok.id << " " << stream;
+                    continue;
+                }
+                st.sendWin += inc;
+                List(c, stream, st);
+                continue;
+            }
+
+            const size_t len = p.data.size() - MUX_HDR_LEN;
+            if (kind != MUX_KIND_DATA || !len) continue;
+
+            if (it == c.streams.end()) {
+                if (c.peerStreams >= maxStreams) {
+                    LOG(WARNING) << "Too many streams " << p.tok.id << " " << stream;
+                    continue;
+                }
+                c.peerStreams++;
+                Get(c, stream).peer = true;
+                it = c.streams.find(stream);
+            }
+
+            Stream &st = it->second;
+            if (len > st.recvWin) {
+                LOG(WARNING) << "Stream window exceeded " << p.tok.id << " " << stream;
+                continue;
             }
+
+            st.recvWin -= (uint32_t)len;
+            p.data.erase(0, MUX_HDR_LEN);
+            out->push_back(Data_t(p.tok, stream, move(p.data)));
+            n++;
         }
 
-        return ret;
-    };
+        packets->clear();
+        return n;
+    }
 
-    MessMemonly::CtData::CtData(PrimitiveMemonly pmo) : pmo(pmo) {}
+    /* Window updates go out first, then data frames round robin. Returns frames queued on m.
+       A connection m refuses frames for (closed, unknown, relayed) is forgotten with all its streams. */
+    size_t StreamMux::Schedule(MessSock *m) {
+        size_t n = 0;
 
-    MessMemonly::MessMemonly() : tokenGen(), cons(), numCons(0) {};
+        for (auto ci = cons.begin(); ci != cons.end();) {
+            if (ScheduleCon(m, ci->first, ci->second, &n)) { ++ci; continue; }
+            LOG(WARNING) << "Stream frames refused, dropping streams of " << ci->first.id;
+            cons.erase(ci++);
+        }
 
-    void MessMemonly::AcceptedConsMulti(const vector<PrimitiveMemonly> &mems) {
-        for (auto &i : mems)
-            if (!cons.insert(make_pair(tokenGen.GetToken(), MessMemonly::CtData(i))).second) assert(0);
+        return n;
+    }
 
-        numCons = cons.size();
+    /* False as soon as m refuses a frame, nothing is charged for that frame */
+    bool StreamMux::ScheduleCon(MessSock *m, const ConToken &tok, Con &c, size_t *n) {
+        for (size_t k = 0; k < c.grants.size(); k++) {
+            const uint32_t i = c.grants[k];
+            Stream &st = c.streams.find(i)->second;
+            const uint32_t inc = htonl(st.grant);
+            Buf b;
+            MuxFrame(&b, MUX_KIND_WINDOW, i, (const char *)&inc, sizeof inc);
+            if (!m->Send(tok, move(b))) return false;
+            st.grant = 0;
+            (*n)++;
+        }
+        c.grants.clear();
+
+        while (!c.ready.empty() && m->Queued(tok) < frameMax) {
+            const uint32_t id = c.ready.front();
+            Stream &st = c.streams.find(id)->second;
+
+            const Buf &f = st.out.front();
+            const size_t len = ZZMIN(ZZMIN(f.size() - st.outOff, frameMax), (size_t)st.sendWin);
+
+            Buf b;
+            MuxFrame(&b, MUX_KIND_DATA, id, f.data() + st.outOff, len);
+            if (!m->Send(tok, move(b))) return false;
+            (*n)++;
+
+            c.ready.pop_front();
+            st.listed = false;
+            st.sendWin -= (uint32_t)len;
+            st.outOff += len;
+            if (st.outOff == f.size()) {
+                st.out.pop_front();
+                st.outOff = 0;
+                if (st.out.empty() && st.closing) c.closes.push_back(id);
+            }
+
+            /* Back of the line, or parked until the peer reopens the window */
+            List(c, id, st);
+        }
+
+        for (auto &i : c.closes) {
+            Buf b;
+            MuxFrame(&b, MUX_KIND_CLOSE, i, "", 0);
+            if (!m->Send(tok, move(b))) return false;
+            Erase(c, i);
+            (*n)++;
+        }
+        c.closes.clear();
+
+        return true;
     }
 
-    vector<ConToken> MessMemonly::GetConTokens() const {
-        vector<ConToken> ret;
+    void StreamMux::Drop(const vector<ConToken> &closed) {
+        for (auto &i : closed) cons.erase(i);
+    }
 
-        for (auto &i : cons)
-            ret.push_back(i.first);
+    void MsgHeader(Buf *out, uint16_t id, size_t bodyLen) {
+        const uint16_t nid = htons(id);
+        out->reserve(out->size() + PACKET_PART_SIZE_LEN + MsgHdrLen + bodyLen);
+        PackLenEx::PutHeader(out, MsgHdrLen + bodyLen);
+        out->append((const char *)&nid, MsgHdrLen);
+    }
 
-        return ret;
+    bool MsgPeekId(const Buf &packet, uint16_t *id) {
+        uint16_t nid;
+        if (packet.size() < MsgHdrLen) return false;
+        memcpy(&nid, packet.data(), MsgHdrLen);
+        *id = ntohs(nid);
+        return true;
     }
 
-    MessSock::Staged_t MessMemonly::StagedRead() {
-        auto r = make_shared<vector<MessSock::StagedRead_t> >();
-        auto d = make_shared<vector<MessSock::StagedDisc_t> >();
-        MessSock::Staged_t ret;
-        ret.r = r;
-        ret.d = d;
+    FlatView::FlatView(const char *p, size_t n) : p(p), n(n) {}
 
-        for (auto &i : cons) {
-            deque<Fragment> w;
+    FlatView::FlatView(const Buf &b) : p(b.data()), n(b.size()) {}
 
-            try {
-                i.second.pmo.ReadU(&w);
-            } catch (NetBlockExc &e) {
-                /* Nothing */
-            } catch (NetDisconnectExc &e) {
-                MessSock::StagedDisc_t mgde = { i.first, true };
-                ret.d->push_back(mgde);
-            } catch (NetFailureExc &e) {
-                MessSock::StagedDisc_t mgde = { i.first, false };
-                ret.d->push_back(mgde);
-            }
+    bool FlatView::ValidP() const {
+        return n >= FLAT_HDR_LEN && n >= FLAT_HDR_LEN + (size_t)Fields() * 4;
+    }
 
-            if (!w.empty()) {
-                MessSock::StagedRead_t mgre = { i.first, w };
-                ret.r->push_back(mgre);
+    uint16_t FlatView::Fields() const {
+        uint16_t c;
+        if (n < FLAT_HDR_LEN) return 0;
+        memcpy(&c, p, sizeof c);
+        return c;
+    }
+
+    uint32_t FlatView::Off(uint16_t f) const {
+        uint32_t off;
+        if (f >= Fields() || n < FLAT_HDR_LEN + ((size_t)f + 1) * 4) return 0;
+        memcpy(&off, p + FLAT_HDR_LEN + (size_t)f * 4, sizeof off);
+        return off;
+    }
+
+    /* Null when absent or when len bytes at the offset would run past the message */
+    const char * FlatView::Field(uint16_t f, size_t len) const {
+        const uint32_t off = Off(f);
+        if (!off || off > n || n - off < len) return nullptr;
+        return p + off;
+    }
+
+    /* Present in the table, the value itself may still be out of bounds */
+    bool FlatView::Has(uint16_t f) const {
+        return Off(f) != 0;
+    }
+
+    uint32_t FlatView::U32(uint16_t f, uint32_t def) const {
+        const char *q = Field(f, sizeof def);
+        if (q) memcpy(&def, q, sizeof def);
+        return def;
+    }
+
+    uint64_t FlatView::U64(uint16_t f, uint64_t def) const {
+        const char *q = Field(f, sizeof def);
+        if (q) memcpy(&def, q, sizeof def);
+        return def;
+    }
+
+    bool FlatView::Bytes(uint16_t f, const char **data, size_t *len) const {
+        uint32_t l;
+        const char *q = Field(f, sizeof l);
+        if (!q) return false;
+        memcpy(&l, q, sizeof l);
+        if ((size_t)(p + n - (q + sizeof l)) < l) return false;
+        *data = q + sizeof l;
+        *len = l;
+        return true;
+    }
+
+    FlatSchema::FlatSchema(const vector<FlatType> &types) : types(types) {}
+
+    /* Absent fields are fine, present ones must fit their type */
+    bool FlatSchema::Check(const FlatView &v) const {
+        if (!v.ValidP() || v.Fields() < types.size()) return false;
+
+        for (uint16_t f = 0; f < types.size(); f++) {
+            if (!v.Has(f)) continue;
+
+            const char *d;
+            size_t l;
+            bool ok = true;
+            switch (types[f]) {
+            case FlatType::U32:   ok = v.U32(f, 0) == v.U32(f, 1); break; /* Defaulted if out of bounds */
+            case FlatType::U64:   ok = v.U64(f, 0) == v.U64(f, 1); break;
+            case FlatType::Bytes: ok = v.Bytes(f, &d, &l); break;
             }
+            if (!ok) return false;
         }
 
-        return ret;
+        return true;
     }
 
-    namespace PackNlDelEx {
+    FlatBuilder::FlatBuilder(Buf *out, uint16_t nfields) : out(out), base(out->size()), nfields(nfields) {
+        PackLenEx::PutHeader(out, 0);
+        out->append((const char *)&nfields, sizeof nfields);
+        out->append(2, '\0');
+        out->append((size_t)nfields * 4, '\0');
+    }
 
-        static bool ReadyPacketPos(PackContIt *fpos) {
-            /* Update iterator only on success */
-            PackContIt pos(*fpos);
+    /* Pads to align (from the message start), records the offset and makes room for len bytes */
+    size_t FlatBuilder::Place(uint16_t f, size_t align, size_t len) {
+        if (f >= nfields) throw exception("Flat field out of range");
+
+        const size_t start = base + PACKET_PART_SIZE_LEN;
+        out->append((align - (out->size() - start) % align) % align, '\0');
+
+        const uint32_t off = (uint32_t)(out->size() - start);
+        memcpy(&(*out)[start + FLAT_HDR_LEN + (size_t)f * 4], &off, sizeof off);
+
+        const size_t at = out->size();
+        out->resize(at + len);
+        return at;
+    }
+
+    void FlatBuilder::PutU32(uint16_t f, uint32_t v) {
+        memcpy(&(*out)[Place(f, sizeof v, sizeof v)], &v, sizeof v);
+    }
+
+    void FlatBuilder::PutU64(uint16_t f, uint64_t v) {
+        memcpy(&(*out)[Place(f, sizeof v, sizeof v)], &v, sizeof v);
+    }
+
+    void FlatBuilder::PutBytes(uint16_t f, const char *data, size_t len) {
+        const uint32_t l = (uint32_t)len;
+        const size_t at = Place(f, sizeof l, sizeof l + len);
+        memcpy(&(*out)[at], &l, sizeof l);
+        if (len) memcpy(&(*out)[at + sizeof l], data, len);
+    }
+
+    /* Patches the frame length, out then holds one complete length-prefixed packet */
+    void FlatBuilder::Finish() {
+        const uint32_t len = htonl((uint32_t)(out->size() - base - PACKET_PART_SIZE_LEN));
+        memcpy(&(*out)[base], &len, sizeof len);
+    }
+
+    /* POD for __declspec(thread). Entries are valid for the packet whose stamp they carry, dictPos (+1, 0 for
+       empty) is rebuilt when the dictionary changes. */
+    struct CompressTls {
+        uint32_t pos[1 << COMPRESS_HASH_LOG];
+        uint32_t stamp[1 << COMPRESS_HASH_LOG];
+        uint32_t cur;
+        const char *dict;
+        size_t dictLen;
+        uint32_t dictPos[1 << COMPRESS_HASH_LOG];
+    };
+
+    static __declspec(thread) CompressTls GCompTls;
+
+    static uint32_t CompressHash(const char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return (v * 2654435761u) >> (32 - COMPRESS_HASH_LOG);
+    }
+
+    static void Lz4Len(Buf *out, size_t n) {
+        for (; n >= 255; n -= 255) out->push_back((char)255);
+        out->push_back((char)n);
+    }
+
+    static void Lz4Literals(Buf *out, const char *lit, size_t nlit, size_t ml) {
+        out->push_back((char)((ZZMIN(nlit, 15) << 4) | ZZMIN(ml, 15)));
+        if (nlit >= 15) Lz4Len(out, nlit - 15);
+        out->append(lit, nlit);
+    }
+
+    CompressStage::Con::Con() : peerHello(false), peerDict(0), in(), skip(0), failed(false) {}
+
+    CompressStage::CompressStage() : cons(), dict(), dictId(0), saved(0), badToks(), minSize(COMPRESS_MIN_DEFAULT) {}
 
-            for (; !pos.EndFragP(); pos.AdvanceFrag()) {
-                size_t posn = pos.CurFragData().find('\n', pos.CurPart());
-                /* size_t posr = pos.CurFragData().find('\r', pos.CurPart()); */
-                /* size_t msgEndPos = posn > 0 && posn-1 == posr ? posr : posn; */
+    /* LZ4 block format, greedy single-probe matching. Matches may reach back into dict but not run across its end.
+       False when the output would not be smaller than the input. */
+    bool CompressStage::Compress(const char *src, size_t n, const char *dict, size_t dictLen, Buf *out) {
+        CompressTls &t = GCompTls;
 
-                if (posn != string::npos) {
-                    pos.AdvanceToPart(posn);
-                    pos.AdvancePart();
+        if (t.dict != dict || t.dictLen != dictLen) {
+            memset(t.dictPos, 0, sizeof t.dictPos);
+            for (size_t i = 0; i + 4 <= dictLen; i++) t.dictPos[CompressHash(dict + i)] = (uint32_t)i + 1;
+            t.dict = dict;
+            t.dictLen = dictLen;
+        }
+
+        if (!++t.cur) {
+            memset(t.stamp, 0, sizeof t.stamp);
+            t.cur = 1;
+        }
 
-                    *fpos = pos;
-                    return true;
+        /* Last match starts 12 bytes before the end at the latest, the last 5 bytes are literals */
+        const size_t limit = out->size() + n;
+        const size_t mfLimit = n > 12 ? n - 12 : 0;
+        const size_t matchEnd = n >= 5 ? n - 5 : 0;
+        size_t anchor = 0, i = 0;
+
+        while (i < mfLimit) {
+            const uint32_t h = CompressHash(src + i);
+            size_t mlen = 0, off = 0;
+
+            if (t.stamp[h] == t.cur) {
+                const size_t c = t.pos[h];
+                if (i - c <= COMPRESS_WINDOW && !memcmp(src + c, src + i, 4)) {
+                    for (mlen = 4; i + mlen < matchEnd && src[c + mlen] == src[i + mlen]; mlen++);
+                    off = i - c;
                 }
             }
 
-            return false;
-        }
+            if (!mlen && t.dictPos[h]) {
+                const size_t c = t.dictPos[h] - 1;
+                if (dictLen - c + i <= COMPRESS_WINDOW && c + 4 <= dictLen && !memcmp(dict + c, src + i, 4)) {
+                    for (mlen = 4; c + mlen < dictLen && i + mlen < matchEnd && dict[c + mlen] == src[i + mlen]; mlen++);
+                    off = dictLen - c + i;
+                }
+            }
+
+            t.stamp[h] = t.cur;
+            t.pos[h] = (uint32_t)i;
 
-        static void GetFromTo(const PackContIt &from, const PackContIt &to, string *accum) {
-            PackContIt it = from;
+            if (!mlen) { i++; continue; }
 
-            /* it.CurPart() is from.CurPart() the first time, and 0 (From it.AdvanceFrag()) afterwards */
-            for (; !it.SameFragP(to); it.AdvanceFrag())
-                accum->append(it.CurFragData().substr(it.CurPart(), string::npos));
+            Lz4Literals(out, src + anchor, i - anchor, mlen - 4);
+            out->push_back((char)(off & 0xff));
+            out->push_back((char)(off >> 8));
+            if (mlen - 4 >= 15) Lz4Len(out, mlen - 4 - 15);
+            if (out->size() >= limit) return false;
 
-            if (!it.EndFragP())
-                accum->append(it.CurFragData().substr(0, to.CurPart()));
+            i += mlen;
+            anchor = i;
         }
 
-        static bool GetPacket(PackContIt *pos, string *out) {
-            PackContIt start = *pos;
+        Lz4Literals(out, src + anchor, n - anchor, 0);
+        return out->size() < limit;
+    }
 
-            if (!PackNlDelEx::ReadyPacketPos(pos))
-                return false;
+    /* Appends exactly rawLen bytes or fails, never reads or writes out of bounds on bad input */
+    bool CompressStage::Decompress(const char *src, size_t n, const char *dict, size_t dictLen, size_t rawLen, Buf *out) {
+        const size_t base = out->size();
+        out->resize(base + rawLen);
+        char *o = &(*out)[0] + base;
+        size_t have = 0, i = 0;
+
+        while (i < n) {
+            const unsigned tok = (unsigned char)src[i++];
+            size_t nlit = tok >> 4, mlen = tok & 15;
+            unsigned b;
+
+            if (nlit == 15) do { if (i >= n) return false; b = (unsigned char)src[i++]; nlit += b; } while (b == 255);
+            if (n - i < nlit || rawLen - have < nlit) return false;
+            memcpy(o + have, src + i, nlit);
+            i += nlit;
+            have += nlit;
+
+            if (i == n) break;
+            if (n - i < 2) return false;
+            const size_t off = (unsigned char)src[i] | ((size_t)(unsigned char)src[i + 1] << 8);
+            i += 2;
+
+            if (mlen == 15) do { if (i >= n) return false; b = (unsigned char)src[i++]; mlen += b; } while (b == 255);
+            mlen += 4;
+            if (!off || off > have + dictLen || rawLen - have < mlen) return false;
+
+            for (; mlen && off > have; mlen--, have++) o[have] = dict[dictLen - (off - have)];
+            if (off >= mlen) memcpy(o + have, o + have - off, mlen);
+            else             for (size_t k = 0; k < mlen; k++) o[have + k] = o[have + k - off];
+            have += mlen;
+        }
+
+        return have == rawLen;
+    }
+
+    void CompressStage::SetDictionary(const char *p, size_t n, uint32_t id) {
+        if (n > COMPRESS_WINDOW) { p += n - COMPRESS_WINDOW; n = COMPRESS_WINDOW; }
+        dict.assign(p, n);
+        dictId = id;
+    }
 
-            PackNlDelEx::GetFromTo(start, *pos, out);
+    bool CompressStage::Block(MessSock *m, const ConToken &tok, char type, const char *p, size_t n) {
+        Buf b;
+        const uint32_t nl = htonl((uint32_t)n);
+        b.reserve(COMPRESS_HDR_LEN + n);
+        b.push_back(type);
+        b.append((const char *)&nl, sizeof nl);
+        b.append(p, n);
+        return m->Send(tok, move(b));
+    }
+
+    /* Switches the connection to blocks and announces our dictionary, the peer must do the same (nothing is
+       negotiated, see the class). Packets go out stored until the peer's hello arrived. */
+    bool CompressStage::Enable(MessSock *m, const ConToken &tok) {
+        cons[tok];
+        const uint32_t id = htonl(dictId);
+        return Block(m, tok, COMPRESS_KIND_HELLO, (const char *)&id, sizeof id);
+    }
+
+    bool CompressStage::PeerHelloP(const ConToken &tok) const {
+        auto it = cons.find(tok);
+        return it != cons.end() && it->second.peerHello;
+    }
+
+    bool CompressStage::Unblock(Con &c, char type, const char *p, size_t n, Buf *out) {
+        const bool useDict = c.peerDict == dictId && dictId;
+        uint32_t v;
+
+        switch (type) {
+        case COMPRESS_KIND_HELLO:
+            if (n != sizeof v) return false;
+            memcpy(&v, p, sizeof v);
+            c.peerHello = true;
+            c.peerDict = ntohl(v);
+            return true;
+        case COMPRESS_KIND_STORED:
+            out->append(p, n);
             return true;
+        case COMPRESS_KIND_LZ4:
+            if (n < sizeof v) return false;
+            memcpy(&v, p, sizeof v);
+            v = ntohl(v);
+            return v <= COMPRESS_BLOCK_MAX && Decompress(p + sizeof v, n - sizeof v, dict.data(), useDict ? dict.size() : 0, v, out);
         }
 
-    };
+        return false;
+    }
 
-    void PostProcess::Process() {
-        LOG(ERROR) << "Empty PostProcess step";
-        throw exception("Empty PostProcess step");
-    };
+    /* Reads of enabled connections are replaced by their decoded bytes, a partial block waits for the next read */
+    void CompressStage::Inflate(vector<MessSock::StagedRead_t> *reads) {
+        for (auto &i : *reads) Inflate(&i);
+    }
 
-    PostProcessFragmentWrite::PostProcessFragmentWrite(shared_ptr<deque<Fragment> > deq, const MessSock::StagedRead_t &sr) : deq(deq), sr(&sr) {}
+    void CompressStage::Inflate(MessSock::StagedRead_t *srp) {
+        MessSock::StagedRead_t &sr = *srp;
+        auto it = cons.find(sr.tok);
+        if (it == cons.end() || sr.in.empty()) return;
+        Con &c = it->second;
+
+        /* Framing is lost after a bad block, nothing more is decoded until the caller closes the connection */
+        if (c.failed) { sr.in.clear(); return; }
+
+        const Stamp stamp = sr.in.front().stamp;
+        for (auto &i : sr.in) c.in.append(i.data);
+        sr.in.clear();
+
+        Buf plain;
+        size_t pos = 0;
+        uint32_t len;
+        while (c.in.size() - pos >= COMPRESS_HDR_LEN) {
+            memcpy(&len, c.in.data() + pos + 1, sizeof len);
+            len = ntohl(len);
+
+            if (len > COMPRESS_BLOCK_MAX) {
+                LOG(WARNING) << "Oversized compressed block " << sr.tok.id;
+                c.failed = true;
+                break;
+            }
+            if (c.in.size() - pos - COMPRESS_HDR_LEN < len) break;
+
+            const size_t good = plain.size();
+            if (!Unblock(c, c.in[pos], c.in.data() + pos + COMPRESS_HDR_LEN, len, &plain)) {
+                LOG(WARNING) << "Bad compressed block " << sr.tok.id;
+                plain.resize(good);
+                c.failed = true;
+                break;
+            }
+            pos += COMPRESS_HDR_LEN + len;
+        }
 
-    void PostProcessFragmentWrite::Process() {
-        for (auto &i : sr->in) deq->push_back(i);
+        if (c.failed) {
+            badToks.push_back(sr.tok);
+            c.in.clear();
+        }
+        else c.in.erase(0, pos);
+        if (!plain.empty()) sr.in.push_back(Fragment(stamp, move(plain)));
     }
 
-    PostProcessCullPrefixAndMerge::PostProcessCullPrefixAndMerge(shared_ptr<deque<Fragment> > in, const deque<Fragment> &extra, const PackContR cont) : in(in), extra(&extra), cont(cont) {}
+    /* One block per COMPRESS_BLOCK_MAX bytes, false once MessSock::Send refuses one.
+       Before the peer's hello arrived, and for unenabled connections, nothing is compressed. */
+    bool CompressStage::Send(MessSock *m, const ConToken &tok, const char *p, size_t n) {
+        auto it = cons.find(tok);
+        if (it == cons.end()) return m->Send(tok, Buf(p, n));
 
-    void PostProcessCullPrefixAndMerge::Process() {
-        if (cont.inIn) {
-            NetData::Fragment::ErasePrefixTo(&(*in), PackCont(cont.fragNo, cont.partNo));
-            NetData::Fragment::CopySuffixFrom(*extra, PackCont(0, 0), &(*in));
-        } else {
-            in->clear();
-            NetData::Fragment::CopySuffixFrom(*extra, PackCont(cont.fragNo, cont.partNo), &(*in));
+        for (size_t off = 0; off < n; off += COMPRESS_BLOCK_MAX)
+            if (!SendBlock(m, tok, it->second, p + off, min<size_t>(n - off, COMPRESS_BLOCK_MAX)))
+                return false;
+
+        return true;
+    }
+
+    bool CompressStage::SendBlock(MessSock *m, const ConToken &tok, Con &c, const char *p, size_t n) {
+        if (!c.peerHello || n < minSize || c.skip) {
+            if (c.skip) c.skip--;
+            return Block(m, tok, COMPRESS_KIND_STORED, p, n);
+        }
+
+        /* Header written up front, patched once the size is known; stored instead unless it saves an eighth */
+        const bool useDict = c.peerDict == dictId && dictId;
+        const uint32_t raw = htonl((uint32_t)n);
+        Buf b;
+        b.reserve(COMPRESS_HDR_LEN + sizeof raw + n);
+        b.append(COMPRESS_HDR_LEN, COMPRESS_KIND_LZ4);
+        b.append((const char *)&raw, sizeof raw);
+
+        if (!Compress(p, n, dict.data(), useDict ? dict.size() : 0, &b) || b.size() - COMPRESS_HDR_LEN > n - n / 8) {
+            c.skip = COMPRESS_SKIP;
+            return Block(m, tok, COMPRESS_KIND_STORED, p, n);
         }
+
+        const uint32_t len = htonl((uint32_t)(b.size() - COMPRESS_HDR_LEN));
+        memcpy(&b[1], &len, sizeof len);
+        saved += n - (b.size() - COMPRESS_HDR_LEN);
+        return m->Send(tok, move(b));
     }
 
-    PostProcessPackWrite::PostProcessPackWrite(shared_ptr<deque<string> > dest, shared_ptr<deque<string> > src) : dest(dest), src(src) {}
+    void CompressStage::Drop(const vector<ConToken> &closed) {
+        for (auto &i : closed) cons.erase(i);
+    }
 
-    void PostProcessPackWrite::Process() {
-        for (auto &i : *src) dest->push_back(i);
+    /* Connections whose input stopped decoding since the last call, to be closed */
+    size_t CompressStage::TakeBadBlocks(vector<ConToken> *out) {
+        const size_t n = badToks.size();
+        out->insert(out->end(), badToks.begin(), badToks.end());
+        badToks.clear();
+        return n;
     }
 
-    PipePacket::PipePacket() :
-        in(make_shared<deque<Fragment> >()),
-        out(make_shared<deque<Fragment> >()),
-        inPack(make_shared<deque<string> >()) {}
+    /* Bytes compression kept off the wire so far */
+    size_t CompressStage::Saved() const {
+        return saved;
+    }
 
-    PipePacket * PipePacket::RemakeForRead(vector<shared_ptr<PostProcess> > *pp, const MessSock::StagedRead_t &sr) {
-        shared_ptr<deque<string> > inP = make_shared<deque<string> >();
+    PipeStage::~PipeStage() {}
 
-        /* Check for completed packets, leave iterator past last completed packet */
-        PackContIt cont(*in, sr.in);
+    bool PipeStage::StatelessP() const {
+        return false;
+    }
 
-        string data;
-        while (NetStuff::PackNlDelEx::GetPacket(&cont, &data)) {
-            inP->push_back(move(data));
-            data = string();
-        }
+    void PipeStage::Span(char *, size_t) {
+        throw exception("Span of a stateful stage");
+    }
 
-        const PackContR finalCont = cont.cont;
+    void PipeStage::Process(MessSock::StagedRead_t *sr) {
+        for (auto &i : sr->in) if (!i.data.empty()) Span(&i.data[0], i.data.size());
+    }
 
-        /* FIXME: CopyConstructed */
-        PipePacket *ret = new PipePacket(*this);
+    StageSpan::StageSpan(void (*fn)(void *ctx, char *p, size_t n), void *ctx) : fn(fn), ctx(ctx) {}
 
-        pp->push_back(make_shared<PostProcessCullPrefixAndMerge>(ret->in, sr.in, finalCont));
-        pp->push_back(make_shared<PostProcessPackWrite>(ret->inPack, inP));
+    bool StageSpan::StatelessP() const {
+        return true;
+    }
 
-        return ret;
+    void StageSpan::Span(char *p, size_t n) {
+        fn(ctx, p, n);
     }
 
-    shared_ptr<Pipe> PipeMaker::MakePacket() {
-        auto p = make_shared<Pipe>();
-        auto r = PipeMaker::MakePacketR();
-        p->pr = r;
-        return p;
+    void StageFused::Process(MessSock::StagedRead_t *sr) {
+        for (auto &i : sr->in) {
+            for (size_t off = 0; off < i.data.size(); off += STAGE_FUSE_BLOCK) {
+                const size_t n = ZZMIN(STAGE_FUSE_BLOCK, i.data.size() - off);
+                for (auto &k : parts) k->Span(&i.data[off], n);
+            }
+        }
     }
 
-    shared_ptr<PipePacket> PipeMaker::MakePacketR() {
-        shared_ptr<PipePacket> pl = make_shared<PipePacket>();
-        pl->pt = PipeType::Packet;
-        return pl;
+    /* Stages run in the order added, a stateless stage joins a stateless predecessor */
+    void StageChain::Add(shared_ptr<PipeStage> stage) {
+        if (!stage->StatelessP() || stages.empty()) {
+            stages.push_back(stage);
+            return;
+        }
+
+        auto fused = dynamic_pointer_cast<StageFused>(stages.back());
+        if (!fused && stages.back()->StatelessP()) {
+            fused = make_shared<StageFused>();
+            fused->parts.push_back(stages.back());
+            stages.back() = fused;
+        }
+
+        if (fused) fused->parts.push_back(stage);
+        else       stages.push_back(stage);
     }
 
-    shared_ptr<PipePacket> PipeMaker::CastPacket(shared_ptr<PipeR> w) {
-        assert(w->pt == PipeType::Packet);
-        auto q = dynamic_pointer_cast<PipePacket>(w);
-        if (!q) throw bad_cast();
-        return q;
+    /* Passes over the data per read, after fusion */
+    size_t StageChain::Stages() const {
+        return stages.size();
     }
 
-    void PipeSet::MergePacketed(const vector<ConToken> &toks) {
-        set<ConToken, ConTokenLess> ptoks, mtoks;
-        for (auto &i : pipes) ptoks.insert(i.first);
-        for (auto &i : toks) mtoks.insert(i);
+    void StageChain::Run(MessSock::StagedRead_t *sr) {
+        for (auto &i : stages) {
+            if (sr->in.empty()) return;
+            i->Process(sr);
+        }
+    }
 
-        vector<ConToken> toCreate;
-        set_difference(mtoks.begin(), mtoks.end(), ptoks.begin(), ptoks.end(), back_inserter(toCreate), ConTokenLess());
+    StageInflate::StageInflate(shared_ptr<CompressStage> cs) : cs(cs) {}
 
-        for (auto &i : toCreate) assert(pipes.find(i) == pipes.end());
-        for (auto &i : toCreate) pipes[i] = PipeMaker::MakePacket();
-        for (auto &i : toCreate) LOG(INFO) << "Creating Packet Pipe " << i.id;
+    void StageInflate::Process(MessSock::StagedRead_t *sr) {
+        cs->Inflate(sr);
     }
 
-    void PipeSet::RemakeForRead(const vector<MessSock::StagedRead_t> &sockReads) {
-        vector<shared_ptr<PostProcess> > pc;
+    namespace HotRestart {
 
-        for (auto &i : sockReads) {
-            if (pipes.find(i.tok) == pipes.end()) { LOG(ERROR) << "Read of inexistant " << i.tok.id; continue; }
-            pipes[i.tok]->pr->RemakeForRead(&pc, i);
+        /* Connections already seen closing are dropped rather than handed over, the sockets are closed as the new process acknowledges them.
+           Connections on other transports (see MessSock::AcceptedPrims) and relayed pairs cannot be handed over, they stay (and are logged). */
+        size_t Export(MessSock *m, PipeSet *ps, HandoffChannel *ch) {
+            size_t n = 0;
+
+            m->RemoveKnownClosed();
+
+            for (auto &tok : m->GetConTokens()) {
+                PollFdType pfd = GNetNat.MakePollFdType(INVALID_SOCKET);
+                deque<Fragment> sockOut;
+
+                if (!m->Snapshot(tok, &pfd, &sockOut)) {
+                    LOG(WARNING) << "Not handing over connection " << tok.id << " (relayed or not a socket)";
+                    continue;
+                }
+
+                auto pit = ps->pipes.find(tok);
+                string meta;
+                SaveCon(&meta, tok, sockOut, pit == ps->pipes.end() ? shared_ptr<Pipe>() : pit->second);
+
+                /* Nothing is given up before the socket is on its way, a failed send leaves the connection as it was */
+                ch->Send(pfd.s, meta);
+                m->Detach(tok, &pfd, 0);
+                ps->Detach(tok);
+                n++;
+            }
+
+            return n;
         }
 
-        for (auto &i : pc) i->Process();
+        size_t Import(MessSock *m, PipeSet *ps, HandoffChannel *ch) {
+            vector<HandoffChannel::Handoff_t> got;
+            size_t n = 0;
+
+            ch->Recv(&got);
+
+            for (auto &i : got) {
+                ConToken want(0);
+                deque<Fragment> sockOut;
+                shared_ptr<Pipe> pipe;
+
+                try {
+                    pipe = LoadCon(i.meta, &want, &sockOut);
+                } catch (exception &) {
+                    LOG(ERROR) << "Dropping handed over connection with unreadable state";
+                    closesocket(i.pfd.s);
+                    continue;
+                }
+
+                ConToken tok = want;
+                if (!m->Adopt(i.pfd, &tok, &sockOut)) continue;
+                if (tok.id != want.id) LOG(WARNING) << "Token " << want.id << " taken, handed over connection is now " << tok.id;
+                ps->Adopt(tok, pipe);
+                n++;
+            }
+
+            return n;
+        }
+
+    };
+
+    /* Pipes without reads for idleTicks give back their buffer capacity (see also BufPool::Trim), drained ones collapse entirely */
+    static bool SamePackConfig(const PackStream &a, const PackStream &b) {
+        return a.maxPacket == b.maxPacket && a.streaming == b.streaming && a.lenPrefix == b.lenPrefix && a.crc == b.crc;
+    }
+
+    /* A drained pipe collapses back to null only when it is framed like packStream, a pipe configured
+       on its own keeps its settings (and its now empty buffers) */
+    void PipeSet::ReclaimIdle(uint32_t idleTicks) {
+        for (auto &i : pipes) {
+            if (!i.second || tick - i.second->lastActive < idleTicks) continue;
+            i.second->pr->Reclaim();
+            if (i.second->pr->DrainedP() && SamePackConfig(PipeMaker::CastPacket(i.second->pr)->stream, packStream)) i.second.reset();
+        }
     }
 
 };
@@ -1,14 +1,18 @@
 #ifndef _NET_STUFF_H_
 #define _NET_STUFF_H_
 
+#include <cassert>
 #include <cstdint>
+#include <cstring>
 
 #include <vector>
 #include <deque>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <string>
 #include <memory>
+#include <new>
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -51,18 +55,82 @@ namespace NetData {
         PackContR(size_t fragNo, size_t partNo, bool inIn);
     };
 
+    /* Process-wide pool of fixed size-class buffers for network data.
+       Requests round up to the smallest class that fits, anything larger goes to the heap.
+       Each thread keeps a short free list per class in front of the shared (locked) lists. */
+    class BufPool {
+    public:
+        enum { NumClasses = 3 };
+
+        static void * Alloc(size_t n);
+        static void Free(void *p, size_t n);
+
+        static size_t ClassOf(size_t n);
+        static size_t ClassSize(size_t c);
+
+        static void Trim();
+        static size_t Cached();
+        static void UseHugePages(bool use);
+    };
+
+    template<typename T>
+    class PoolAlloc {
+    public:
+        typedef T value_type;
+        typedef T * pointer;
+        typedef const T * const_pointer;
+        typedef T & reference;
+        typedef const T & const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template<typename U> struct rebind { typedef PoolAlloc<U> other; };
+
+        PoolAlloc() {}
+        template<typename U> PoolAlloc(const PoolAlloc<U> &) {}
+
+        pointer address(reference x) const { return &x; }
+        const_pointer address(const_reference x) const { return &x; }
+
+        pointer allocate(size_type n, const void * = 0) { return (pointer)BufPool::Alloc(n * sizeof(T)); }
+        void deallocate(pointer p, size_type n) { BufPool::Free(p, n * sizeof(T)); }
+
+        size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+        void construct(pointer p, const T &v) { new ((void *)p) T(v); }
+        void destroy(pointer p) { p->~T(); }
+    };
+
+    template<typename T, typename U> bool operator==(const PoolAlloc<T> &, const PoolAlloc<U> &) { return true; }
+    template<typename T, typename U> bool operator!=(const PoolAlloc<T> &, const PoolAlloc<U> &) { return false; }
+
+    typedef basic_string<char, char_traits<char>, PoolAlloc<char> > Buf;
+
+    /* CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has it, table driven otherwise.
+       Update continues a running value, start from 0. */
+    namespace Crc32c {
+        uint32_t Update(uint32_t crc, const char *p, size_t n);
+        bool HardwareP();
+    };
+
+    /* Immutable once queued, one copy shared by every connection it goes out on (see MessSock::Broadcast) */
+    typedef shared_ptr<const Buf> SharedBuf;
+
     class Fragment {
     public:
         Stamp stamp;
-        string data;
+        Buf data;
 
         Fragment(const Stamp &s, const string &d);
+        Fragment(const Stamp &s, const char *d);
+        Fragment(const Stamp &s, Buf &&d);
 
-        string SplitFragPrefix(size_t partNo) const;
-        string SplitFragSuffix(size_t partNo) const;
+        Buf SplitFragPrefix(size_t partNo) const;
+        Buf SplitFragSuffix(size_t partNo) const;
 
         static void ErasePrefixTo(deque<Fragment> *deq, const PackCont &pc);
         static void CopySuffixFrom(const deque<Fragment> &deq, const PackCont &pc, deque<Fragment> *out);
+        static void CoalesceSmall(deque<Fragment> *deq, size_t smallMax, size_t blockMax);
     };
 
     /* FIXME: Is this even used? */
@@ -97,22 +165,100 @@ namespace NetNative {
         friend class NetFuncs;
     };
 
+    struct ListenSpec {
+        string addr; /* Empty for the wildcard address */
+        string port;
+        int family;
+        bool dualStack;  /* AF_INET6 only: also accept IPv4 (mapped) connections */
+        int backlog;
+        int deferAccept; /* Seconds, 0 for off */
+        int fastOpen;    /* Pending TFO request queue length, 0 for off */
+        string path;     /* AF_UNIX only, replaces addr / port */
+
+        ListenSpec();
+        ListenSpec(const string &port);
+        ListenSpec(const string &addr, const string &port, int family);
+
+        static ListenSpec Unix(const string &path);
+    };
+
     class PrimitiveListening {
+    private:
+        mutable size_t nextListener;
+        vector<int> families; /* Per listener */
+
+        SOCKET Listen(const ListenSpec &spec);
+        SOCKET ListenUnix(const ListenSpec &spec);
+
     public:
-        PollFdType pfd;
+        vector<PollFdType> pfds;
+        size_t acceptBatchMax;
 
         PrimitiveListening();
+        PrimitiveListening(const vector<ListenSpec> &specs);
         virtual ~PrimitiveListening();
 
         vector<PollFdType> Accept() const;
+        size_t AcceptBatch(vector<PollFdType> *out, size_t maxN) const;
+    };
+
+    /* Per-connection read size, a moving average of observed reads.
+       Grows toward SO_RCVBUF while reads keep filling the buffer, decays for chatty peers. */
+    class ReadSizer {
+    public:
+        uint32_t avg;
+        uint32_t cap; /* SO_RCVBUF, 0 until first queried */
+
+        ReadSizer();
+
+        size_t NextSize(size_t pending) const;
+        void Observe(size_t got, size_t want);
     };
 
     class NetFuncs {
     public:
         bool ErrorWouldBlock();
-        void PollFdTypeRead(const PollFdType &pfd, deque<NetData::Fragment>* w);
+        bool ErrorAcceptTransient();
+        void PollFdTypeRead(const PollFdType &pfd, deque<NetData::Fragment>* w, ReadSizer *rs);
+        size_t PollFdTypeWrite(const PollFdType &pfd, WSABUF *bufs, size_t n);
+        size_t PollFdTypeRcvBuf(const PollFdType &pfd);
+        bool SetupAccepted(SOCKET s, int family);
+        bool SetupFastOpen(SOCKET s, int qlen);
+        bool SetupDeferAccept(SOCKET s, int secs);
 
         PollFdType MakePollFdType(SOCKET s);
+        PollFdType ConnectUnix(const string &path);
+    };
+
+    extern NetFuncs GNetNat;
+
+    /* Moves live sockets (plus opaque per-connection state) to another process over an AF_UNIX
+       connection. Both ends introduce themselves with their process id on construction, each
+       adopted socket is acknowledged so the sender knows when its own copy may be closed. */
+    class HandoffChannel {
+    public:
+        struct Handoff_t {
+            PollFdType pfd;
+            string meta;
+        };
+
+    private:
+        PollFdType pfd;
+        uint32_t peerPid; /* 0 until the peer's hello arrived */
+        string rbuf;
+        string wbuf; /* Queued control messages the socket has not taken yet */
+        deque<SOCKET> unacked;
+
+        void SendMsg(uint32_t type, const char *data, size_t len, const string &meta);
+
+    public:
+        HandoffChannel(PollFdType pfd);
+        ~HandoffChannel();
+
+        bool PeerKnown() const;
+        bool Flush();
+        void Send(SOCKET s, const string &meta);
+        size_t Recv(vector<Handoff_t> *out);
     };
 
     /* FIXME: Is this even used? */
@@ -124,14 +270,75 @@ namespace NetNative {
         virtual void ReadU(deque<NetData::Fragment>* w);
     };
 
+    struct ShmHdr;
+
+    /* Same-host connection over a pair of single producer / single consumer byte rings in a named
+       shared memory section. The creator writes ring 0 and reads ring 1, the opener the reverse.
+       Nothing but the mapping is touched per message, the doorbell event is only set for a reader
+       that announced (Wait) it is going to sleep. */
+    class PrimitiveShm : public NetData::PrimitiveBase {
+    private:
+        HANDLE map;
+        HANDLE bell[2];
+        ShmHdr *hdr;
+        char *ring[2];
+        int side;
+
+        PrimitiveShm();
+        void Attach(const string &name, bool create, uint32_t cap);
+
+    public:
+        ~PrimitiveShm();
+
+        static shared_ptr<PrimitiveShm> Create(const string &name, uint32_t cap);
+        static shared_ptr<PrimitiveShm> Open(const string &name);
+
+        virtual void WriteU(deque<NetData::Fragment>* w);
+        virtual void ReadU(deque<NetData::Fragment>* w);
+
+        bool Wait(DWORD ms);
+        void Close();
+    };
+
+    struct Datagram_t {
+        sockaddr_storage peer;
+        int peerLen;
+        NetData::Buf data;
+    };
+
+    /* Bound UDP socket moving datagrams in batches. Winsock has no recvmmsg / sendmmsg, batches drain
+       the socket until it would block; with offload, the stack coalesces received datagrams of one
+       peer (URO) and splits equal-sized sends to one peer (USO), so a batch costs a few calls. */
+    class PrimitiveDatagram {
+    private:
+        SOCKET s;
+        bool offload;
+        DWORD segSize;       /* UDP_SEND_MSG_SIZE currently set, 0 for none */
+        vector<char> rbuf;
+
+        void SetSegSize(DWORD seg);
+
+    public:
+        PrimitiveDatagram(const ListenSpec &spec, bool offload);
+        ~PrimitiveDatagram();
+
+        size_t RecvBatch(vector<Datagram_t> *out, size_t maxN);
+        size_t SendBatch(deque<Datagram_t> *q, size_t maxN);
+        bool OffloadP() const;
+    };
+
     class MessSockSlave {
     private:
         vector<pollfd> pfds;
 
     public:
         void RebuildPollFrom(const vector<PollFdType> &p);
+        size_t AddPollFd(const PollFdType &p);
+        void RemovePollFd(size_t idx);
+        void SetPollEvents(size_t idx, short events);
+        short Revents(size_t idx) const;
         void ReadyForPoll();
-        vector<bool> PerformPoll();
+        vector<size_t> PerformPoll();
     };
 
 };
@@ -180,27 +387,40 @@ namespace NetStuff {
         ConTokenGen();
 
         ConToken GetToken();
+        bool Claim(ConToken tok);
+        bool Empty() const;
 
         void ReturnToken(ConToken tok);
     };
 
-    class PackContIt : public ::std::iterator<::std::input_iterator_tag, Fragment> {
+    /* Cursor over a span of buffer segments (a pipe's pending input followed by the new read), addressed by absolute byte offset.
+       Advancing within a segment is O(1), seeking is a binary search over the segment end offsets. */
+    class SegCursor {
     public:
-        /* Should be CopyConstructible, Assignable */
-        const deque<Fragment> *fst, *snd;
-        PackContR cont;
-        mutable int canary, canary_limit; /* FIXME: Cheese */
+        vector<const Buf *> segs;
+        vector<size_t> ends;
+        size_t seg, off, pos;
+
+        SegCursor();
+        SegCursor(const deque<Fragment> &fst, const deque<Fragment> &snd);
+
+        void Append(const deque<Fragment> &deq);
+
+        size_t Pos() const;
+        size_t Size() const;
+        bool EndP() const;
 
-        PackContIt(const deque<Fragment> &fst, const deque<Fragment> &snd);
-        void AdvancePart();
-        void AdvanceFrag();
-        void AdvanceToPart(size_t w);
-        const string & CurFragData() const;
-        size_t CurPart() const;
-        bool EndFragP() const;
-        bool SameFragP(const PackContIt &rhs) const;
+        void Advance(size_t n);
+        void Seek(size_t abs);
+        bool Find(char c, size_t *at) const;
 
-        static void GetFromTo(const PackContIt &from, const PackContIt &to, string *accum);
+        const char * Contiguous(size_t from, size_t n) const;
+        bool Peek(size_t from, size_t n, char *dst) const;
+        void GetRange(size_t from, size_t to, string *accum) const;
+        void GetRange(size_t from, size_t to, Buf *accum) const;
+        uint32_t GetRangeCrc(size_t from, size_t to, Buf *accum) const;
+
+        PackContR ContR(size_t fstSegs) const;
     };
 
     class MessSock {
@@ -215,30 +435,82 @@ namespace NetStuff {
         };
 
     private:
+        /* One direction of a relayed pair, bytes read from this connection waiting to be sent to peer */
+        struct RelayState {
+            ConToken peer;
+            vector<char> buf;
+            size_t off, len;
+            bool eof;  /* Nothing more to read, peer's send side is shut once drained */
+            bool shut;
+            RelayState(ConToken peer);
+        };
+
+        /* Queued output, off bytes of buf already sent */
+        struct OutSeg {
+            SharedBuf buf;
+            size_t off;
+        };
+
         struct CtData {
             PollFdType pfd;
-            deque<Fragment> in;
-            deque<Fragment> out;
+            size_t pollIdx;
+            shared_ptr<PrimitiveBase> prim; /* Non-socket transports, not in the poll set */
+            shared_ptr<RelayState> relay;   /* Paired, bytes bypass StagedRead */
+            ReadSizer rs;
+            shared_ptr<deque<OutSeg> > out;
+            bool writeListed;
             bool knownClosed;
-            CtData(PollFdType pfd);
+            uint32_t lastActive;
+            CtData(PollFdType pfd, size_t pollIdx);
+            CtData(shared_ptr<PrimitiveBase> prim);
         };
 
         ConTokenGen tokenGen;
         map<ConToken, CtData, ConTokenLess> cons;
         uint32_t numCons;
+        uint32_t tick;
 
         MessSockSlave aux;
+        vector<ConToken> pollToks; /* Owner of each poll set entry */
+        vector<ConToken> primToks;
+
+        vector<ConToken> evOpened, evClosed;
+
+        vector<ConToken> writeToks;     /* Connections with output queued */
+        vector<StagedDisc_t> writeDisc; /* Write failures, reported by the next StagedRead */
+
+        bool Enqueue(const ConToken &tok, const SharedBuf &data);
+        void WriteCon(CtData &ct);
+        static void OutAdvance(deque<OutSeg> *q, size_t n);
 
-        vector<PollFdType> GetPollFds();
-        void UpdateCons();
-        void AddConsMulti(const vector<PollFdType> &pfds, const vector<ConToken> toks, const vector<CtData> cts);
+        void StagedReadCon(const ConToken &tok, CtData &ct, Staged_t *ret);
+        void Unlink(const ConToken &tok, const CtData &ct);
+        void RelayPump(const ConToken &tok, CtData &src, Staged_t *ret);
+        bool RelayFlush(CtData &src, CtData &dst);
+        void RelayEvents(const CtData &ct, const CtData &peer);
 
     public:
         MessSock();
 
-        void AcceptedConsMulti(const vector<PollFdType> &pfds);
+        vector<ConToken> AcceptedConsMulti(const vector<PollFdType> &pfds);
+        vector<ConToken> AcceptedPrims(const vector<shared_ptr<PrimitiveBase> > &prims);
         vector<ConToken> GetConTokens() const;
         Staged_t StagedRead();
+        void RemoveKnownClosed();
+        void TakeConEvents(vector<ConToken> *opened, vector<ConToken> *closed);
+        void ReclaimIdle(uint32_t idleTicks);
+
+        bool Send(const ConToken &tok, Buf &&data);
+        size_t Broadcast(const vector<ConToken> &toks, const SharedBuf &data);
+        size_t Queued(const ConToken &tok) const;
+        size_t StagedWrite();
+
+        void Pair(const ConToken &a, const ConToken &b);
+        size_t Peek(const ConToken &tok, char *dst, size_t n) const;
+
+        bool Snapshot(const ConToken &tok, PollFdType *pfd, deque<Fragment> *out) const;
+        bool Detach(const ConToken &tok, PollFdType *pfd, deque<Fragment> *out);
+        bool Adopt(PollFdType pfd, ConToken *tok, deque<Fragment> *out);
     };
 
     class MessMemonly {
@@ -251,23 +523,100 @@ namespace NetStuff {
         map<ConToken, CtData, ConTokenLess> cons;
         uint32_t numCons;
 
+        vector<ConToken> evOpened;
+
     public:
         MessMemonly();
 
         void AcceptedConsMulti(const vector<PrimitiveMemonly> &mems);
         vector<ConToken> GetConTokens() const;
         MessSock::Staged_t StagedRead();
+        void TakeConEvents(vector<ConToken> *opened, vector<ConToken> *closed);
+    };
+
+    /* Datagrams are routed to a ConToken per peer address and staged like socket reads.
+       Each datagram carries whole packets (same framing as streams) so a PipeSet parses them as usual. */
+    class MessDatagram {
+        struct Peer {
+            sockaddr_storage addr;
+            int addrLen;
+            uint32_t lastActive;
+        };
+
+        shared_ptr<PrimitiveDatagram> prim;
+        ConTokenGen tokenGen;
+        map<string, ConToken> byAddr; /* Raw sockaddr bytes */
+        map<ConToken, Peer, ConTokenLess> peers;
+        vector<Datagram_t> rbatch;
+        deque<Datagram_t> out;
+        uint32_t tick;
+
+        vector<ConToken> evOpened, evClosed;
+
+    public:
+        size_t batchMax;
+
+        MessDatagram(shared_ptr<PrimitiveDatagram> prim);
+
+        vector<ConToken> GetConTokens() const;
+        MessSock::Staged_t StagedRead();
+        void Send(const ConToken &tok, Buf &&data);
+        size_t Flush();
+        void ReclaimIdle(uint32_t idleTicks);
+        void TakeConEvents(vector<ConToken> *opened, vector<ConToken> *closed);
     };
 
     namespace PackNlDelEx {
-        bool ReadyPacketPos(PackContIt *fpos);
-        bool GetPacket(PackContIt *pos, string *out);
+        bool ReadyPacketPos(SegCursor *fpos);
+        bool GetPacket(SegCursor *pos, Buf *out);
     };
 
+    /* Binary-safe framing: a 4 byte big-endian payload length, then the payload. Packets are delivered without the header.
+       Optionally the payload is followed by its CRC32C (big-endian, not counted in the length). */
+    namespace PackLenEx {
+        bool FrameLen(const SegCursor &pos, uint32_t *len);
+        bool GetPacket(SegCursor *pos, Buf *out);
+        bool GetPacketCrc(SegCursor *pos, Buf *out, bool *ok);
+        void PutHeader(Buf *out, size_t len);
+        void PutTrailer(Buf *out, size_t payloadStart);
+        void Frame(Buf *out, const char *p, size_t n, bool crc);
+    };
+
+    /* The framer, last stage of a connection's input; anything ahead of it is a StageChain (PipeSet::chains) */
     enum class PipeType {
         Packet
     };
 
+    enum class PackPart {
+        Whole,
+        Begin,
+        Continue,
+        End
+    };
+
+    struct PackChunk {
+        PackPart part;
+        Buf data;
+        PackChunk(PackPart part, Buf &&data);
+    };
+
+    /* Oversized packet handling. Without streaming, packets over maxPacket are dropped.
+       With streaming, every packet goes to PipePacket::inStream: Whole ones as is,
+       oversized ones as Begin, Continue.., End chunks as the data arrives. */
+    struct PackStream {
+        size_t maxPacket; /* 0 for unlimited */
+        bool streaming;
+        bool open;        /* Begin delivered, End pending */
+        bool discarding;  /* Dropping until the delimiter */
+        bool lenPrefix;   /* PackLenEx framing instead of PackNlDelEx */
+        size_t left;      /* PackLenEx: bytes of the oversized packet still to come */
+        bool crc;         /* PackLenEx: CRC32C trailers, checked except on oversized packets */
+        uint32_t bad;     /* Packets dropped for a bad CRC, collected by PipeSet */
+
+        PackStream();
+        PackStream(size_t maxPacket, bool streaming);
+    };
+
     struct PostProcess {
         virtual void Process();
     };
@@ -278,6 +627,8 @@ namespace NetStuff {
     class PipeI {
     public:
         virtual PipeR * RemakeForRead(vector<shared_ptr<PostProcess> > *pp, const MessSock::StagedRead_t &sr) = 0;
+        virtual void Reclaim() = 0;
+        virtual bool DrainedP() const = 0;
     };
 
     class PipeR : public PipeI {
@@ -288,6 +639,8 @@ namespace NetStuff {
     class Pipe {
     public:
         shared_ptr<PipeR> pr;
+        uint32_t lastActive;
+        Pipe();
     };
 
     struct PostProcessFragmentWrite : PostProcess {
@@ -297,48 +650,573 @@ namespace NetStuff {
         virtual void Process();
     };
 
+    /* Pipe buffers below are allocated on first use and released once empty, these steps take the owning slot */
     struct PostProcessCullPrefixAndMerge : PostProcess {
         PackContR cont;
-        shared_ptr<deque<Fragment> > in;
+        shared_ptr<deque<Fragment> > *in;
         const deque<Fragment> *extra;
-        PostProcessCullPrefixAndMerge(shared_ptr<deque<Fragment> > in, const deque<Fragment> &extra, const PackContR cont);
+        PostProcessCullPrefixAndMerge(shared_ptr<deque<Fragment> > *in, const deque<Fragment> &extra, const PackContR cont);
         virtual void Process();
     };
 
     struct PostProcessPackWrite : PostProcess {
-        shared_ptr<deque<string> > dest;
-        shared_ptr<deque<string> > src;
-        PostProcessPackWrite(shared_ptr<deque<string> > dest, shared_ptr<deque<string> > src);
+        shared_ptr<deque<Buf> > *dest;
+        shared_ptr<deque<Buf> > src;
+        PostProcessPackWrite(shared_ptr<deque<Buf> > *dest, shared_ptr<deque<Buf> > src);
+        virtual void Process();
+    };
+
+    struct PostProcessChunkWrite : PostProcess {
+        shared_ptr<deque<PackChunk> > *dest;
+        shared_ptr<deque<PackChunk> > src;
+        PostProcessChunkWrite(shared_ptr<deque<PackChunk> > *dest, shared_ptr<deque<PackChunk> > src);
         virtual void Process();
     };
 
+    struct PostProcessStreamWrite : PostProcess {
+        PackStream *dest;
+        PackStream src;
+        PostProcessStreamWrite(PackStream *dest, const PackStream &src);
+        virtual void Process();
+    };
+
+    /* Buffers are null while empty, an idle pipe is just its header */
     class PipePacket : public PipeR {
     public:
         shared_ptr<deque<Fragment> > in;
         shared_ptr<deque<Fragment> > out;
 
-        shared_ptr<deque<string> > inPack;
+        shared_ptr<deque<Buf> > inPack;
+        shared_ptr<deque<PackChunk> > inStream;
+
+        PackStream stream;
 
         PipePacket();
 
         virtual PipePacket * RemakeForRead(vector<shared_ptr<PostProcess> > *pp, const MessSock::StagedRead_t &sr);
+        virtual void Reclaim();
+        virtual bool DrainedP() const;
     };
 
     class PipeMaker {
     private:
-        static shared_ptr<PipePacket> MakePacketR();
+        static shared_ptr<PipePacket> MakePacketR(const PackStream &ps);
     public:
         static shared_ptr<Pipe> MakePacket();
+        static shared_ptr<Pipe> MakePacket(const PackStream &ps);
 
         static shared_ptr<PipePacket> CastPacket(shared_ptr<PipeR> w);
     };
 
+    /* One step of a connection's input path ahead of its framer (the PipeR). Stages rewrite the staged
+       fragments in place; stateless ones only transform bytes (Span) and are fused by StageChain. */
+    class PipeStage {
+    public:
+        virtual ~PipeStage();
+        virtual bool StatelessP() const;
+        virtual void Span(char *p, size_t n);
+        virtual void Process(MessSock::StagedRead_t *sr);
+    };
+
+    /* Stateless hook (e.g. a stream cipher with a position-independent keystream) */
+    class StageSpan : public PipeStage {
+        void (*fn)(void *ctx, char *p, size_t n);
+        void *ctx;
+
+    public:
+        StageSpan(void (*fn)(void *ctx, char *p, size_t n), void *ctx);
+
+        virtual bool StatelessP() const;
+        virtual void Span(char *p, size_t n);
+    };
+
+    /* Adjacent stateless stages, run together over each cache-sized block so the data is walked once */
+    class StageFused : public PipeStage {
+    public:
+        vector<shared_ptr<PipeStage> > parts;
+
+        virtual void Process(MessSock::StagedRead_t *sr);
+    };
+
+    class StageChain {
+        vector<shared_ptr<PipeStage> > stages;
+
+    public:
+        void Add(shared_ptr<PipeStage> stage);
+        size_t Stages() const;
+        void Run(MessSock::StagedRead_t *sr);
+    };
+
     class PipeSet {
     public:
+        struct Popped_t {
+            ConToken tok;
+            Buf data;
+            Popped_t(ConToken tok, Buf &&data);
+        };
+
+        struct PoppedChunk_t {
+            ConToken tok;
+            PackPart part;
+            Buf data;
+            PoppedChunk_t(ConToken tok, PackChunk &&chunk);
+        };
+
+    private:
+        uint32_t popNext; /* Connection PopPackets starts at, rotates for fairness */
+        uint32_t chunkNext; /* Same for PopChunks */
+        size_t queued;
+        vector<ConToken> badToks;
+
+        size_t PopFrom(const ConToken &tok, Pipe *p, vector<Popped_t> *out, size_t maxN);
+        size_t PopChunksFrom(const ConToken &tok, Pipe *p, vector<PoppedChunk_t> *out, size_t maxN);
+        void RemakeFramed(const vector<MessSock::StagedRead_t> &sockReads);
+
+    public:
+        /* Null for connections that have not sent anything (or were drained and reclaimed) */
         map<ConToken, shared_ptr<Pipe>, ConTokenLess> pipes;
+        map<ConToken, shared_ptr<StageChain>, ConTokenLess> chains; /* Connections without one go straight to the framer */
+        PackStream packStream; /* Applied to pipes created from here on */
+        uint32_t tick;
+
+        PipeSet();
+
+        size_t PopPackets(vector<Popped_t> *out, size_t maxN);
+        size_t PopPackets(const ConToken &tok, vector<Popped_t> *out, size_t maxN);
+        size_t PopChunks(vector<PoppedChunk_t> *out, size_t maxN);
+        size_t PopChunks(const ConToken &tok, vector<PoppedChunk_t> *out, size_t maxN);
+        size_t QueueDepth() const;
+        size_t QueueDepth(const ConToken &tok) const;
+        size_t TakeBadPackets(vector<ConToken> *out);
+
+        void ReclaimIdle(uint32_t idleTicks);
 
         void MergePacketed(const vector<ConToken> &toks);
+        void MergeConEvents(const vector<ConToken> &opened, const vector<ConToken> &closed);
         void RemakeForRead(const vector<MessSock::StagedRead_t> &sockReads);
+        void RemakeForRead(vector<MessSock::StagedRead_t> *sockReads);
+        void SetChain(const vector<ConToken> &toks, shared_ptr<StageChain> chain);
+
+        shared_ptr<Pipe> Detach(const ConToken &tok);
+        void Adopt(const ConToken &tok, shared_ptr<Pipe> pipe);
+    };
+
+    /* Consistent hash ring, each worker owns vnodes points. Adding or removing a worker only moves
+       the keys between its points and their predecessors, about 1/N of them. */
+    class HashRing {
+        map<uint32_t, uint32_t> points; /* Point -> worker */
+
+    public:
+        uint32_t vnodes;
+
+        HashRing();
+
+        static uint32_t Hash(const char *p, size_t n);
+
+        void Add(uint32_t worker);
+        void Remove(uint32_t worker);
+        bool Lookup(uint32_t h, uint32_t *worker) const;
+        bool Empty() const;
+    };
+
+    /* Front-end of a local cluster: accepted connections (by peer address) or individual packets
+       (by key) are consistent-hashed to worker processes. Connections are handed over through the
+       worker's HandoffChannel, packets are written to its packet transport (e.g. a PrimitiveShm). */
+    class ClusterFront {
+        struct Worker {
+            shared_ptr<HandoffChannel> ch;
+            shared_ptr<PrimitiveBase> pkt;
+            deque<Fragment> pending; /* Packets pkt didn't take yet */
+        };
+
+        HashRing ring;
+        map<uint32_t, Worker> workers;
+
+    public:
+        uint32_t (*keyHash)(const Buf &packet);
+
+        ClusterFront();
+
+        void AddWorker(uint32_t id, shared_ptr<HandoffChannel> ch, shared_ptr<PrimitiveBase> pkt);
+        void RemoveWorker(uint32_t id);
+
+        size_t Dispatch(const vector<PollFdType> &accepted);
+        size_t Route(vector<PipeSet::Popped_t> *packets);
+        size_t Flush();
+        void Pump();
+
+        static uint32_t LeadingFieldHash(const Buf &packet);
+    };
+
+    /* Pub/sub over framed packets: "+topic" subscribes the sender, "-topic" unsubscribes it, anything
+       else publishes the whole packet to the subscribers of its leading field. Topics are bucketed by
+       hash, a publish is one lookup and one shared buffer queued on every subscriber (MessSock::Broadcast). */
+    class TopicRouter {
+        struct Topic {
+            string name;
+            vector<ConToken> subs;
+        };
+
+        unordered_map<uint32_t, vector<Topic> > topics;
+        map<ConToken, vector<string>, ConTokenLess> subsOf;
+
+        Topic * Find(const char *name, size_t len, bool create);
+
+    public:
+        void Subscribe(const string &topic, const ConToken &tok);
+        void Unsubscribe(const string &topic, const ConToken &tok);
+        void Drop(const vector<ConToken> &closed);
+        size_t Subscribers(const string &topic);
+        size_t Topics() const;
+
+        size_t Route(MessSock *m, vector<PipeSet::Popped_t> *packets);
+    };
+
+    /* Pipelined request / response over length-prefixed pipes (PackStream::lenPrefix). Each message starts
+       with a kind byte and a correlation id, so any number of calls can be in flight per connection and
+       replies may arrive in any order. Pending calls sit in a dense slot table, an id carries its slot and
+       the slot's generation so a late reply to a reused slot is ignored. */
+    class RpcEndpoint {
+    public:
+        enum class Status {
+            Ok,
+            Timeout,
+            Closed
+        };
+
+        struct Request_t {
+            ConToken tok;
+            uint32_t id;
+            Buf body;
+            Request_t(ConToken tok, uint32_t id, Buf &&body);
+        };
+
+        struct Completion_t {
+            ConToken tok;
+            uint32_t id;
+            Status status;
+            Buf body;
+            Completion_t(ConToken tok, uint32_t id, Status status, Buf &&body);
+        };
+
+    private:
+        struct Slot {
+            ConToken tok;
+            uint32_t deadline; /* 0 for none */
+            uint16_t gen;
+            bool used;
+            Slot();
+        };
+
+        vector<Slot> slots;
+        vector<uint32_t> freeSlots;
+        size_t inFlight;
+
+        void Finish(uint32_t slot, Status status, Buf &&body, vector<Completion_t> *done);
+
+    public:
+        RpcEndpoint();
+
+        uint32_t Call(MessSock *m, const ConToken &tok, const char *body, size_t len, uint32_t deadline);
+        bool Reply(MessSock *m, const ConToken &tok, uint32_t id, const char *body, size_t len);
+
+        size_t Dispatch(vector<PipeSet::Popped_t> *packets, vector<Request_t> *requests, vector<Completion_t> *done);
+        size_t Expire(uint32_t now, vector<Completion_t> *done);
+        size_t Drop(const vector<ConToken> &closed, vector<Completion_t> *done);
+        size_t InFlight() const;
+    };
+
+    /* Many logical streams over one length-prefixed connection. Frames carry a stream id, a stream exists once
+       it is written to or heard from. Each direction of a stream has a credit window the receiver reopens with
+       Consumed. Schedule hands a connection one frame per ready stream in turn and stops while about a frame
+       is still unsent, so a control stream waits behind at most one frame of a bulk one. */
+    class StreamMux {
+    public:
+        struct Data_t {
+            ConToken tok;
+            uint32_t stream;
+            Buf data;
+            Data_t(ConToken tok, uint32_t stream, Buf &&data);
+        };
+
+    private:
+        struct Stream {
+            uint32_t sendWin; /* Bytes the peer still takes */
+            uint32_t recvWin; /* Bytes we still take */
+            uint32_t grant;   /* Consumed, not yet announced */
+            deque<Buf> out;
+            size_t outOff;
+            bool listed;      /* In ready */
+            bool closing;     /* Close frame goes out once out drains */
+            bool peer;        /* Opened by the peer's data */
+            Stream();
+        };
+
+        struct Con {
+            map<uint32_t, Stream> streams;
+            deque<uint32_t> ready;   /* Streams with output and window, round robin */
+            vector<uint32_t> grants; /* Streams with window updates to send */
+            vector<uint32_t> closes; /* Streams with their close frame to send */
+            size_t peerStreams;
+            Con();
+        };
+
+        map<ConToken, Con, ConTokenLess> cons;
+
+        Stream & Get(Con &c, uint32_t stream);
+        void List(Con &c, uint32_t stream, Stream &st);
+        void Erase(Con &c, uint32_t stream);
+        bool ScheduleCon(MessSock *m, const ConToken &tok, Con &c, size_t *n);
+
+    public:
+        uint32_t window;  /* Initial window of every stream, both ends must agree */
+        size_t frameMax;
+        size_t maxStreams; /* Peer-opened streams per connection */
+
+        StreamMux();
+
+        void Write(const ConToken &tok, uint32_t stream, const char *data, size_t len);
+        void Close(const ConToken &tok, uint32_t stream);
+        void Consumed(const ConToken &tok, uint32_t stream, size_t n);
+        size_t Pending(const ConToken &tok, uint32_t stream) const;
+
+        size_t Dispatch(vector<PipeSet::Popped_t> *packets, vector<Data_t> *out);
+        size_t Schedule(MessSock *m);
+        void Drop(const vector<ConToken> &closed);
+    };
+
+    /* Typed messages over length-prefixed pipes: a 2 byte big-endian type id, then the body. Message types
+       carry their id as enum Id and a static Decode; MsgPod supplies both for plain structs (raw bytes,
+       host order). A MsgDispatch is built from a type list (MsgList, up to 8 types, no variadic templates
+       on this compiler): one function pointer per id, each decoding into a stack struct before calling
+       Handler::On(tok, msg). */
+    enum { MsgHdrLen = 2 };
+
+    void MsgHeader(Buf *out, uint16_t id, size_t bodyLen);
+    bool MsgPeekId(const Buf &packet, uint16_t *id);
+
+    template<typename M, uint16_t I>
+    struct MsgPod {
+        enum { Id = I };
+
+        static bool Decode(const char *p, size_t n, M *out) {
+            if (n != sizeof(M)) return false;
+            memcpy(out, p, n);
+            return true;
+        }
+    };
+
+    template<typename M>
+    void MsgPut(Buf *out, const M &m) {
+        MsgHeader(out, M::Id, sizeof m);
+        out->append((const char *)&m, sizeof m);
+    }
+
+    struct MsgNil {};
+
+    template<typename H, typename T>
+    struct MsgCons {
+        typedef H Head;
+        typedef T Tail;
+    };
+
+    template<typename T1, typename T2 = MsgNil, typename T3 = MsgNil, typename T4 = MsgNil,
+             typename T5 = MsgNil, typename T6 = MsgNil, typename T7 = MsgNil, typename T8 = MsgNil>
+    struct MsgList {
+        typedef MsgCons<T1, typename MsgList<T2, T3, T4, T5, T6, T7, T8>::Type> Type;
+    };
+
+    template<>
+    struct MsgList<MsgNil> {
+        typedef MsgNil Type;
+    };
+
+    template<typename L>
+    struct MsgMaxId {
+        enum { Rest = MsgMaxId<typename L::Tail>::value };
+        enum { value = (int)L::Head::Id > (int)Rest ? (int)L::Head::Id : (int)Rest };
+    };
+
+    template<>
+    struct MsgMaxId<MsgNil> {
+        enum { value = 0 };
+    };
+
+    template<typename Handler, typename M>
+    bool MsgCall(Handler *h, const ConToken &tok, const char *p, size_t n) {
+        M m;
+        if (!M::Decode(p, n, &m)) return false;
+        h->On(tok, m);
+        return true;
+    }
+
+    template<typename Handler, typename L>
+    struct MsgFill {
+        template<typename Fn>
+        static void Do(Fn *table) {
+            assert(!table[L::Head::Id] && "Duplicate message id");
+            table[L::Head::Id] = &MsgCall<Handler, typename L::Head>;
+            MsgFill<Handler, typename L::Tail>::Do(table);
+        }
+    };
+
+    template<typename Handler>
+    struct MsgFill<Handler, MsgNil> {
+        template<typename Fn>
+        static void Do(Fn *) {}
+    };
+
+    template<typename Handler, typename L>
+    class MsgDispatch {
+    public:
+        enum { Size = MsgMaxId<L>::value + 1 };
+        typedef bool (*Fn)(Handler *h, const ConToken &tok, const char *p, size_t n);
+
+    private:
+        Fn table[Size];
+
+    public:
+        MsgDispatch() {
+            for (size_t i = 0; i < Size; i++) table[i] = nullptr;
+            MsgFill<Handler, L>::Do(table);
+        }
+
+        /* False for unknown ids and bodies the type fails to decode */
+        bool Dispatch(Handler *h, const ConToken &tok, const Buf &packet) const {
+            uint16_t id;
+            if (!MsgPeekId(packet, &id) || id >= Size || !table[id]) return false;
+            return table[id](h, tok, packet.data() + MsgHdrLen, packet.size() - MsgHdrLen);
+        }
+
+        /* Consumes packets, returns the number handled */
+        size_t Dispatch(Handler *h, vector<PipeSet::Popped_t> *packets) const {
+            size_t n = 0;
+            for (auto &i : *packets) n += Dispatch(h, i.tok, i.data) ? 1 : 0;
+            packets->clear();
+            return n;
+        }
+    };
+
+    /* Offset-addressed binary messages, read in place. Layout: u16 field count, u16 reserved, a u32 offset per
+       field (0 when absent, from the message start), then the values, each aligned to its size. Values are
+       little-endian and loaded with memcpy, so no access depends on the buffer's alignment; reading a field
+       touches only the offset table entry and the value. FlatBuilder writes the length-prefixed frame
+       straight into a (pooled) Buf ready for MessSock::Send. */
+    enum class FlatType {
+        U32,
+        U64,
+        Bytes /* u32 length, then the bytes */
+    };
+
+    class FlatView {
+        const char *p;
+        size_t n;
+
+        uint32_t Off(uint16_t f) const;
+        const char * Field(uint16_t f, size_t len) const;
+
+    public:
+        FlatView(const char *p, size_t n);
+        FlatView(const Buf &b);
+
+        bool ValidP() const;
+        uint16_t Fields() const;
+        bool Has(uint16_t f) const;
+
+        uint32_t U32(uint16_t f, uint32_t def) const;
+        uint64_t U64(uint16_t f, uint64_t def) const;
+        bool Bytes(uint16_t f, const char **data, size_t *len) const;
+    };
+
+    /* Field types by index; Check validates a whole message once so later reads can't fail */
+    class FlatSchema {
+    public:
+        vector<FlatType> types;
+
+        FlatSchema(const vector<FlatType> &types);
+
+        bool Check(const FlatView &v) const;
+    };
+
+    class FlatBuilder {
+        Buf *out;
+        size_t base; /* Frame header, message starts after it */
+        uint16_t nfields;
+
+        size_t Place(uint16_t f, size_t align, size_t len);
+
+    public:
+        FlatBuilder(Buf *out, uint16_t nfields);
+
+        void PutU32(uint16_t f, uint32_t v);
+        void PutU64(uint16_t f, uint64_t v);
+        void PutBytes(uint16_t f, const char *data, size_t len);
+        void Finish();
+    };
+
+    /* Per-connection compression between the socket and the framer. This is not negotiated: both ends must be
+       configured alike and Enable the connection before anything else is sent on it, a peer that did not sees the
+       blocks as garbage. From then on everything travels in blocks: a hello carrying the dictionary id, stored
+       blocks and LZ4 blocks. Inflate turns a connection's staged reads back into plain bytes before
+       PipeSet::RemakeForRead, Send compresses a packet in blocks of up to 4MiB. The dictionary (last 64KiB used) is only applied when the peer announced
+       the same id. Packets under minSize are stored as is, so is everything for a while after a packet that
+       failed to compress well. Match tables are per thread and never cleared between packets. */
+    class CompressStage {
+        struct Con {
+            bool peerHello;
+            uint32_t peerDict;
+            Buf in;        /* Incomplete block */
+            uint32_t skip; /* Packets to store before trying again */
+            bool failed;   /* Undecodable input seen */
+            Con();
+        };
+
+        map<ConToken, Con, ConTokenLess> cons;
+        Buf dict;
+        uint32_t dictId;
+        size_t saved;
+        vector<ConToken> badToks;
+
+        bool Block(MessSock *m, const ConToken &tok, char type, const char *p, size_t n);
+        bool SendBlock(MessSock *m, const ConToken &tok, Con &c, const char *p, size_t n);
+        bool Unblock(Con &c, char type, const char *p, size_t n, Buf *out);
+
+    public:
+        size_t minSize;
+
+        CompressStage();
+
+        void SetDictionary(const char *p, size_t n, uint32_t id);
+        bool Enable(MessSock *m, const ConToken &tok);
+        bool PeerHelloP(const ConToken &tok) const;
+
+        void Inflate(MessSock::StagedRead_t *sr);
+        void Inflate(vector<MessSock::StagedRead_t> *reads);
+        bool Send(MessSock *m, const ConToken &tok, const char *p, size_t n);
+        void Drop(const vector<ConToken> &closed);
+        size_t TakeBadBlocks(vector<ConToken> *out);
+        size_t Saved() const;
+
+        static bool Compress(const char *src, size_t n, const char *dict, size_t dictLen, Buf *out);
+        static bool Decompress(const char *src, size_t n, const char *dict, size_t dictLen, size_t rawLen, Buf *out);
+    };
+
+    class StageInflate : public PipeStage {
+        shared_ptr<CompressStage> cs;
+
+    public:
+        StageInflate(shared_ptr<CompressStage> cs);
+
+        virtual void Process(MessSock::StagedRead_t *sr);
+    };
+
+    /* Zero-downtime restart: the old process exports every socket connection (socket, unparsed input, parsed
+       packets not yet popped, queued output) over a HandoffChannel, the new one imports and keeps parsing
+       where the old one stopped. Bytes still in the kernel socket buffer simply move with the socket.
+       Relayed pairs and connections over other transports stay with the old process. */
+    namespace HotRestart {
+        size_t Export(MessSock *m, PipeSet *ps, HandoffChannel *ch);
+        size_t Import(MessSock *m, PipeSet *ps, HandoffChannel *ch);
     };
 
 };
@@ -11,10 +11,66 @@ using namespace NetData;
 using namespace NetStuff;
 using namespace NetNative;
 
+struct MsgPing : MsgPod<MsgPing, 1> {
+    uint32_t seq;
+};
+
+struct MsgMove : MsgPod<MsgMove, 4> {
+    int32_t x, y;
+};
+
+/* Variable length body, decoded by hand */
+struct MsgSay {
+    enum { Id = 2 };
+    char text[32];
+    size_t len;
+
+    static bool Decode(const char *p, size_t n, MsgSay *out) {
+        if (n > sizeof out->text) return false;
+        memcpy(out->text, p, n);
+        out->len = n;
+        return true;
+    }
+};
+
+struct MsgCounter {
+    uint32_t pings, seqSum;
+    int32_t xy;
+    string said;
+
+    MsgCounter() : pings(0), seqSum(0), xy(0) {}
+
+    void On(const ConToken &, const MsgPing &m) { pings++; seqSum += m.seq; }
+    void On(const ConToken &, const MsgMove &m) { xy += m.x * m.y; }
+    void On(const ConToken &, const MsgSay &m)  { said.append(m.text, m.len); }
+};
+
+static void XorSpan(void *ctx, char *p, size_t n) {
+    for (const char k = *(const char *)ctx; n; n--) *p++ ^= k;
+}
+
 namespace UnitTest1 {
 
     shared_ptr<WinsockWrap> ww;
 
+    SOCKET ConnectLocal(const char *port) {
+        struct addrinfo *res = nullptr;
+        struct addrinfo hints = {0};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo("127.0.0.1", port, &hints, &res)) return INVALID_SOCKET;
+
+        SOCKET s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (s != INVALID_SOCKET && connect(s, res->ai_addr, res->ai_addrlen) == SOCKET_ERROR) {
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+
+        freeaddrinfo(res);
+        return s;
+    }
+
     TEST_MODULE_INITIALIZE(Hello1) {
         LogincInit();
         ww = make_shared<WinsockWrap>();
@@ -88,5 +144,1218 @@ namespace UnitTest1 {
             }
         };
 
+        TEST_METHOD(AcceptBatch) {
+            auto pl = make_shared<PrimitiveListening>();
+
+            vector<SOCKET> cls;
+            for (size_t i = 0; i < 5; i++) cls.push_back(ConnectLocal("27010"));
+            for (auto &i : cls) Assert::IsTrue(i != INVALID_SOCKET);
+
+            Sleep(100);
+
+            vector<PollFdType> acc;
+            Assert::IsTrue(pl->AcceptBatch(&acc, 2) == 2);
+            Assert::IsTrue(pl->AcceptBatch(&acc, 2) == 2);
+            Assert::IsTrue(pl->AcceptBatch(&acc, 2) == 1);
+            Assert::IsTrue(pl->AcceptBatch(&acc, 2) == 0);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(acc);
+            Assert::IsTrue(m->GetConTokens().size() == 5);
+
+            /* Past the token limit, sockets are closed rather than registered */
+            {
+                auto mf = make_shared<MessSock>();
+                vector<PollFdType> full;
+                for (size_t i = 0; i < 101; i++) full.push_back(GNetNat.MakePollFdType(socket(AF_INET, SOCK_STREAM, 0)));
+                Assert::IsTrue(mf->AcceptedConsMulti(full).size() == 100 && mf->GetConTokens().size() == 100);
+                ConToken want(3);
+                deque<Fragment> none;
+                Assert::IsTrue(!mf->Adopt(GNetNat.MakePollFdType(socket(AF_INET, SOCK_STREAM, 0)), &want, &none) && mf->GetConTokens().size() == 100);
+                for (size_t i = 0; i < 100; i++) closesocket(full[i].s);
+            }
+
+            send(cls[3], "abc\n", 4, 0);
+            Sleep(100);
+
+            const auto sg = m->StagedRead();
+            Assert::IsTrue(sg.r->size() == 1 && (*sg.r)[0].tok.id == 3);
+
+            for (auto &i : cls) closesocket(i);
+            for (auto &i : acc) closesocket(i.s);
+        };
+
+
+        TEST_METHOD(ListenMulti) {
+            vector<ListenSpec> specs;
+            specs.push_back(ListenSpec("27011"));
+            specs.push_back(ListenSpec("::", "27012", AF_INET6));
+            specs.back().backlog = 16;
+            specs.back().fastOpen = 16;
+
+            auto pl = make_shared<PrimitiveListening>(specs);
+            Assert::IsTrue(pl->pfds.size() == 2);
+
+            /* IPv4 client reaches the dual stack listener through a mapped address */
+            vector<SOCKET> cls;
+            cls.push_back(ConnectLocal("27011"));
+            cls.push_back(ConnectLocal("27012"));
+            cls.push_back(ConnectLocal("27012"));
+            for (auto &i : cls) Assert::IsTrue(i != INVALID_SOCKET);
+
+            Sleep(100);
+
+            vector<PollFdType> acc;
+            Assert::IsTrue(pl->AcceptBatch(&acc, 2) == 2);
+            Assert::IsTrue(pl->AcceptBatch(&acc, 2) == 1);
+
+            for (auto &i : cls) closesocket(i);
+            for (auto &i : acc) closesocket(i.s);
+        };
+
+
+        TEST_METHOD(ReadSizerAdapt) {
+            ReadSizer rs;
+            rs.cap = 256 * 1024;
+
+            /* Bulk: reads keep filling the buffer */
+            for (size_t i = 0; i < 20; i++) rs.Observe(rs.NextSize(0), rs.NextSize(0));
+            Assert::IsTrue(rs.NextSize(0) == rs.cap);
+
+            /* Chatty: small reads decay the average, the pending hint still wins when larger */
+            for (size_t i = 0; i < 100; i++) rs.Observe(10, rs.NextSize(10));
+            Assert::IsTrue(rs.NextSize(0) < 1024);
+            Assert::IsTrue(rs.NextSize(5000) == 5000);
+        };
+
+        TEST_METHOD(ReadBulk) {
+            vector<ListenSpec> specs;
+            specs.push_back(ListenSpec("27013"));
+            auto pl = make_shared<PrimitiveListening>(specs);
+
+            SOCKET cl = ConnectLocal("27013");
+            Assert::IsTrue(cl != INVALID_SOCKET);
+            u_long blockmode = 1;
+            ioctlsocket(cl, FIONBIO, &blockmode);
+            Sleep(100);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(pl->Accept());
+            Assert::IsTrue(m->GetConTokens().size() == 1);
+
+            const string chunk(64 * 1024, 'x');
+            size_t sent = 0, recvd = 0, frags = 0;
+
+            for (size_t i = 0; i < 1000 && recvd < 1024 * 1024; i++) {
+                if (sent < 1024 * 1024) {
+                    int r = send(cl, chunk.data(), (int)min(chunk.size(), 1024 * 1024 - sent), 0);
+                    if (r > 0) sent += r;
+                }
+
+                const auto sg = m->StagedRead();
+                for (auto &j : *sg.r) for (auto &k : j.in) { recvd += k.data.size(); frags++; }
+            }
+
+            Assert::IsTrue(recvd == 1024 * 1024);
+            Assert::IsTrue(frags < 1024 / 8);
+
+            /* Sized for bulk, a short read still comes back in a buffer of its own size */
+            SOCKET c2 = ConnectLocal("27013");
+            Sleep(100);
+            const auto acc = pl->Accept();
+            send(c2, "hi\n", 3, 0);
+            Sleep(100);
+
+            ReadSizer rs;
+            rs.avg = rs.cap = 256 * 1024;
+            deque<Fragment> w;
+            try { GNetNat.PollFdTypeRead(acc[0], &w, &rs); } catch (NetBlockExc &) {}
+            Assert::IsTrue(w.size() == 1 && w[0].data == "hi\n" && w[0].data.capacity() < 1024);
+
+            closesocket(c2);
+            closesocket(acc[0].s);
+
+            closesocket(cl);
+        };
+
+
+        TEST_METHOD(FragCoalesce) {
+            deque<Fragment> deq;
+            deq.push_back(Fragment(EmptyStamp(), "a"));
+            deq.push_back(Fragment(EmptyStamp(), "b"));
+            deq.push_back(Fragment(EmptyStamp(), string(1000, 'L')));
+            deq.push_back(Fragment(EmptyStamp(), "c"));
+            deq.push_back(Fragment(EmptyStamp(), "d"));
+            deq.push_back(Fragment(EmptyStamp(), "e"));
+
+            Fragment::CoalesceSmall(&deq, 512, 2);
+
+            Assert::IsTrue(deq.size() == 4);
+            Assert::IsTrue(deq[0].data == "ab" && deq[1].data.size() == 1000 && deq[2].data == "cd" && deq[3].data == "e");
+
+            /* Nothing adjacent to merge, nothing is moved */
+            const char *big = deq[1].data.data();
+            deq.erase(deq.begin() + 3);
+            Fragment::CoalesceSmall(&deq, 512, 2);
+            Assert::IsTrue(deq.size() == 3 && deq[1].data.data() == big && deq[2].data == "cd");
+        };
+
+        TEST_METHOD(MsgCoalesce) {
+            vector<const char *> pmss(100, "a");
+            pmss.push_back("\n");
+            pmss.push_back(0);
+            pmss.push_back(0);
+            vector<PrimitiveMemonly> pms = PrimitiveMemonly::MakePrims(pmss.data());
+
+            auto m = make_shared<MessMemonly>();
+            m->AcceptedConsMulti(pms);
+
+            auto ps = make_shared<PipeSet>();
+            ps->MergePacketed(m->GetConTokens());
+
+            for (size_t i = 0; i < 100; i++) {
+                const auto sg = m->StagedRead();
+                ps->RemakeForRead(*sg.r);
+                Assert::IsTrue(PipeMaker::CastPacket(ps->pipes[0]->pr)->in->size() <= 8 + 1);
+            }
+
+            const auto sg = m->StagedRead();
+            ps->RemakeForRead(*sg.r);
+
+            auto w = PipeMaker::CastPacket(ps->pipes[0]->pr);
+            Assert::IsTrue(w->inPack->size() == 1 && w->inPack->front() == Buf(100, 'a') + "\n");
+        };
+
+
+        TEST_METHOD(MsgOversized) {
+            const char *pmss[] = {
+                "0123456789", "abcdefghij", "xy\n", "ok\n", 0,
+                0,
+            };
+
+            for (int streaming = 0; streaming < 2; streaming++) {
+                auto m = make_shared<MessMemonly>();
+                m->AcceptedConsMulti(PrimitiveMemonly::MakePrims(pmss));
+
+                auto ps = make_shared<PipeSet>();
+                ps->packStream = PackStream(8, !!streaming);
+                ps->MergePacketed(m->GetConTokens());
+
+                for (size_t i = 0; i < 5; i++) {
+                    const auto sg = m->StagedRead();
+                    ps->RemakeForRead(*sg.r);
+                    /* Never buffers more than the limit */
+                    size_t buffered = 0;
+                    if (auto in = PipeMaker::CastPacket(ps->pipes[0]->pr)->in)
+                        for (auto &j : *in) buffered += j.data.size();
+                    Assert::IsTrue(buffered <= 8);
+                }
+
+                auto w = PipeMaker::CastPacket(ps->pipes[0]->pr);
+
+                if (!streaming) {
+                    Assert::IsTrue(w->inPack->size() == 1 && w->inPack->front() == "ok\n");
+                    Assert::IsTrue(!w->inStream);
+                } else {
+                    Assert::IsTrue(!w->inPack && w->inStream->size() == 4);
+                    Assert::IsTrue((*w->inStream)[0].part == PackPart::Begin && (*w->inStream)[0].data == "0123456789");
+                    Assert::IsTrue((*w->inStream)[1].part == PackPart::Continue && (*w->inStream)[1].data == "abcdefghij");
+                    Assert::IsTrue((*w->inStream)[2].part == PackPart::End && (*w->inStream)[2].data == "xy\n");
+                    Assert::IsTrue((*w->inStream)[3].part == PackPart::Whole && (*w->inStream)[3].data == "ok\n");
+
+                    /* Chunks count towards the depth and pop like packets do */
+                    vector<PipeSet::PoppedChunk_t> out;
+                    Assert::IsTrue(ps->QueueDepth() == 4 && ps->QueueDepth(ConToken(0)) == 4);
+                    Assert::IsTrue(ps->PopChunks(&out, 3) == 3 && out[0].part == PackPart::Begin && out[2].data == "xy\n");
+                    Assert::IsTrue(ps->PopChunks(ConToken(0), &out, 8) == 1 && out[3].part == PackPart::Whole);
+                    Assert::IsTrue(ps->QueueDepth() == 0);
+                }
+            }
+        };
+
+
+        TEST_METHOD(SegCursorSeek) {
+            deque<Fragment> fst, snd;
+            fst.push_back(Fragment(EmptyStamp(), "abc"));
+            fst.push_back(Fragment(EmptyStamp(), ""));
+            fst.push_back(Fragment(EmptyStamp(), "de"));
+            snd.push_back(Fragment(EmptyStamp(), "f\ngh"));
+
+            SegCursor c(fst, snd);
+            Assert::IsTrue(c.Size() == 9 && c.Pos() == 0);
+
+            size_t at;
+            Assert::IsTrue(c.Find('\n', &at) && at == 6);
+            Assert::IsTrue(!c.Find('z', &at));
+
+            string r;
+            c.GetRange(1, 7, &r);
+            Assert::IsTrue(r == "bcdef\n");
+
+            char pk[4];
+            Assert::IsTrue(c.Peek(2, 4, pk) && string(pk, 4) == "cdef");
+            Assert::IsTrue(c.Contiguous(0, 3) != nullptr && c.Contiguous(2, 2) == nullptr);
+
+            c.Seek(3);
+            Assert::IsTrue(c.ContR(fst.size()).fragNo == 2 && c.ContR(fst.size()).partNo == 0 && c.ContR(fst.size()).inIn);
+            c.Advance(3);
+            Assert::IsTrue(c.Pos() == 6 && c.ContR(fst.size()).fragNo == 0 && c.ContR(fst.size()).partNo == 1 && !c.ContR(fst.size()).inIn);
+            c.Advance(100);
+            Assert::IsTrue(c.EndP() && c.ContR(fst.size()).fragNo == 1 && !c.ContR(fst.size()).inIn);
+        };
+
+
+        TEST_METHOD(BufPoolReclaim) {
+            Assert::IsTrue(BufPool::ClassOf(1) == 0 && BufPool::ClassOf(4096) == 1 && BufPool::ClassOf(64 * 1024 + 1) == BufPool::NumClasses);
+
+            BufPool::Trim();
+
+            {
+                vector<Fragment> frags;
+                for (size_t i = 0; i < 100; i++) frags.push_back(Fragment(EmptyStamp(), string(3000, 'x')));
+            }
+            Assert::IsTrue(BufPool::Cached() >= 100 * 4096);
+
+            BufPool::Trim();
+            Assert::IsTrue(BufPool::Cached() == 0);
+
+            const char *pmss[] = {
+                "aaa\n", "bb", 0,
+                0,
+            };
+            auto m = make_shared<MessMemonly>();
+            m->AcceptedConsMulti(PrimitiveMemonly::MakePrims(pmss));
+
+            auto ps = make_shared<PipeSet>();
+            ps->MergePacketed(m->GetConTokens());
+            for (size_t i = 0; i < 2; i++) {
+                const auto sg = m->StagedRead();
+                ps->RemakeForRead(*sg.r);
+            }
+
+            ps->ReclaimIdle(0);
+
+            auto w = PipeMaker::CastPacket(ps->pipes[0]->pr);
+            Assert::IsTrue(w->in->size() == 1 && w->in->front().data == "bb" && w->inPack->size() == 1);
+        };
+
+
+        TEST_METHOD(LazyPipeState) {
+            const char *pmss[] = {
+                "aa\n", 0,
+                0,
+            };
+            auto m = make_shared<MessMemonly>();
+            m->AcceptedConsMulti(PrimitiveMemonly::MakePrims(pmss));
+
+            auto ps = make_shared<PipeSet>();
+            ps->MergePacketed(m->GetConTokens());
+            Assert::IsTrue(ps->pipes.size() == 1 && !ps->pipes[0]);
+
+            const auto sg = m->StagedRead();
+            ps->RemakeForRead(*sg.r);
+
+            /* Packets but no pending input */
+            auto w = PipeMaker::CastPacket(ps->pipes[0]->pr);
+            Assert::IsTrue(!w->in && !w->out && !w->inStream && w->inPack->size() == 1);
+
+            vector<PipeSet::Popped_t> out;
+            Assert::IsTrue(ps->PopPackets(&out, 8) == 1 && ps->QueueDepth() == 0);
+            ps->ReclaimIdle(0);
+            Assert::IsTrue(!ps->pipes[0]);
+
+            /* A pipe configured apart from the set keeps its settings */
+            ps->pipes[0] = PipeMaker::MakePacket(PackStream(64, true));
+            ps->ReclaimIdle(0);
+            Assert::IsTrue(ps->pipes[0] && PipeMaker::CastPacket(ps->pipes[0]->pr)->stream.maxPacket == 64);
+        };
+
+        TEST_METHOD(ConEvents) {
+            vector<ListenSpec> specs;
+            specs.push_back(ListenSpec("27014"));
+            auto pl = make_shared<PrimitiveListening>(specs);
+
+            SOCKET cla = ConnectLocal("27014");
+            SOCKET clb = ConnectLocal("27014");
+            Sleep(100);
+
+            vector<PollFdType> acc;
+            Assert::IsTrue(pl->AcceptBatch(&acc, 8) == 2);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(acc);
+
+            vector<ConToken> opened, closed;
+            m->TakeConEvents(&opened, &closed);
+            Assert::IsTrue(opened.size() == 2 && closed.empty());
+
+            auto ps = make_shared<PipeSet>();
+            ps->MergeConEvents(opened, closed);
+            Assert::IsTrue(ps->pipes.size() == 2);
+
+            closesocket(cla);
+            send(clb, "bb\n", 3, 0);
+            Sleep(100);
+
+            const auto sg = m->StagedRead();
+            Assert::IsTrue(sg.d->size() == 1);
+            ps->RemakeForRead(*sg.r);
+
+            m->RemoveKnownClosed();
+            m->TakeConEvents(&opened, &closed);
+            Assert::IsTrue(opened.empty() && closed.size() == 1 && closed[0].id == (*sg.d)[0].tok.id);
+            ps->MergeConEvents(opened, closed);
+            Assert::IsTrue(ps->pipes.size() == 1 && m->GetConTokens().size() == 1);
+
+            /* Survivor was swapped into the freed poll slot and still reads */
+            send(clb, "cc\n", 3, 0);
+            Sleep(100);
+            ps->RemakeForRead(*m->StagedRead().r);
+
+            auto w = PipeMaker::CastPacket(ps->pipes.begin()->second->pr);
+            Assert::IsTrue(w->inPack->size() == 2 && w->inPack->back() == "cc\n");
+
+            /* Opened and closed between two calls: neither is reported, no phantom pipe */
+            SOCKET clc = ConnectLocal("27014");
+            Sleep(100);
+            m->AcceptedConsMulti(pl->Accept());
+            closesocket(clc);
+            Sleep(100);
+            m->StagedRead();
+            m->RemoveKnownClosed();
+            m->TakeConEvents(&opened, &closed);
+            Assert::IsTrue(opened.empty() && closed.empty());
+            ps->MergeConEvents(opened, closed);
+            Assert::IsTrue(ps->pipes.size() == 1 && m->GetConTokens().size() == 1);
+
+            closesocket(clb);
+        };
+
+        TEST_METHOD(PopBatch) {
+            const char *pmss[] = {
+                "a\nb\nc\n", 0,
+                "d\ne\n", 0,
+                0,
+            };
+            auto m = make_shared<MessMemonly>();
+            m->AcceptedConsMulti(PrimitiveMemonly::MakePrims(pmss));
+
+            auto ps = make_shared<PipeSet>();
+            ps->MergePacketed(m->GetConTokens());
+            ps->RemakeForRead(*m->StagedRead().r);
+            Assert::IsTrue(ps->QueueDepth() == 5 && ps->QueueDepth(ConToken(1)) == 2);
+
+            vector<PipeSet::Popped_t> out;
+            Assert::IsTrue(ps->PopPackets(ConToken(1), &out, 1) == 1 && out[0].tok.id == 1 && out[0].data == "d\n");
+
+            /* Budget runs out inside the first connection, the next call resumes with the other one */
+            out.clear();
+            Assert::IsTrue(ps->PopPackets(&out, 2) == 2 && out[1].data == "b\n");
+            out.clear();
+            Assert::IsTrue(ps->PopPackets(&out, 1) == 1 && out[0].data == "e\n");
+            out.clear();
+            Assert::IsTrue(ps->PopPackets(&out, 8) == 1 && out[0].data == "c\n");
+
+            Assert::IsTrue(ps->QueueDepth() == 0 && ps->PopPackets(&out, 8) == 0);
+        };
+
+        TEST_METHOD(ShmRing) {
+            auto a = PrimitiveShm::Create("NetStuffTestShm", 4096);
+            auto b = PrimitiveShm::Open("NetStuffTestShm");
+
+            /* A second Create would reset the live ring */
+            bool exists = false;
+            try { PrimitiveShm::Create("NetStuffTestShm", 4096); } catch (exception &) { exists = true; }
+            Assert::IsTrue(exists);
+
+            auto m = make_shared<MessSock>();
+            Assert::IsTrue(m->AcceptedPrims(vector<shared_ptr<PrimitiveBase> >(1, a)).size() == 1);
+
+            vector<ConToken> opened, closed;
+            m->TakeConEvents(&opened, &closed);
+            auto ps = make_shared<PipeSet>();
+            ps->MergeConEvents(opened, closed);
+            Assert::IsTrue(!a->Wait(0));
+
+            /* Wraps around the ring a few times */
+            const string line = string(3000, 'x') + "\n";
+            for (size_t i = 0; i < 4; i++) {
+                deque<Fragment> w(1, Fragment(EmptyStamp(), line));
+                b->WriteU(&w);
+                Assert::IsTrue(w.empty() && a->Wait(0));
+                ps->RemakeForRead(*m->StagedRead().r);
+            }
+
+            vector<PipeSet::Popped_t> out;
+            Assert::IsTrue(ps->PopPackets(&out, 8) == 4 && out[3].data.size() == 3001);
+
+            /* Full ring, the rest stays with the writer */
+            deque<Fragment> w(1, Fragment(EmptyStamp(), string(5000, 'y')));
+            bool blocked = false;
+            try { b->WriteU(&w); } catch (NetBlockExc &e) { blocked = true; }
+            Assert::IsTrue(blocked && w.size() == 1 && w.front().data.size() == 5000 - 4096);
+
+            /* Data written before the close still arrives first */
+            b.reset();
+            const auto sg = m->StagedRead();
+            Assert::IsTrue(sg.r->size() == 1 && (*sg.r)[0].in.front().data.size() == 4096 && sg.d->empty());
+            Assert::IsTrue(m->StagedRead().d->size() == 1);
+
+            m->RemoveKnownClosed();
+            Assert::IsTrue(m->GetConTokens().empty());
+        };
+
+        TEST_METHOD(UnixHandoff) {
+            auto pu = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec::Unix("NetStuffTest.sock")));
+            PollFdType wc = GNetNat.ConnectUnix("NetStuffTest.sock");
+            Sleep(100);
+
+            vector<PollFdType> acc;
+            Assert::IsTrue(pu->AcceptBatch(&acc, 8) == 1);
+
+            HandoffChannel front(acc[0]), worker(wc);
+            vector<HandoffChannel::Handoff_t> got;
+            Sleep(100);
+            front.Recv(&got);
+            worker.Recv(&got);
+            Assert::IsTrue(front.PeerKnown() && worker.PeerKnown() && got.empty());
+
+            /* A live socket or a plain file at the path is never removed */
+            bool inUse = false, notSock = false;
+            try { PrimitiveListening(vector<ListenSpec>(1, ListenSpec::Unix("NetStuffTest.sock"))); } catch (exception &) { inUse = true; }
+            fclose(fopen("NetStuffTest.file", "w"));
+            try { PrimitiveListening(vector<ListenSpec>(1, ListenSpec::Unix("NetStuffTest.file"))); } catch (exception &) { notSock = true; }
+            remove("NetStuffTest.file");
+            Assert::IsTrue(inUse && notSock);
+
+            /* A TCP connection accepted by the front moves to the worker along with some state */
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27015")));
+            SOCKET cl = ConnectLocal("27015");
+            Sleep(100);
+            acc.clear();
+            Assert::IsTrue(pl->AcceptBatch(&acc, 8) == 1);
+
+            front.Send(acc[0].s, "state");
+            Sleep(100);
+            Assert::IsTrue(worker.Recv(&got) == 1 && got[0].meta == "state");
+            Sleep(100);
+            front.Recv(&got);
+
+            /* Front's copy is closed by now, the worker's still works */
+            send(cl, "hi\n", 3, 0);
+            Sleep(100);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(vector<PollFdType>(1, got[0].pfd));
+            const auto sg = m->StagedRead();
+            Assert::IsTrue(sg.r->size() == 1 && (*sg.r)[0].in.front().data == "hi\n");
+
+            closesocket(cl);
+        };
+
+        TEST_METHOD(DatagramPeers) {
+            auto md = make_shared<MessDatagram>(make_shared<PrimitiveDatagram>(ListenSpec("127.0.0.1", "27016", AF_INET), false));
+
+            sockaddr_in sa = {0};
+            sa.sin_family = AF_INET;
+            sa.sin_port = htons(27016);
+            inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+
+            SOCKET ca = socket(AF_INET, SOCK_DGRAM, 0), cb = socket(AF_INET, SOCK_DGRAM, 0);
+            sendto(ca, "a\n", 2, 0, (const sockaddr *)&sa, sizeof sa);
+            sendto(cb, "c\n", 2, 0, (const sockaddr *)&sa, sizeof sa);
+            sendto(ca, "b\n", 2, 0, (const sockaddr *)&sa, sizeof sa);
+            Sleep(100);
+
+            /* One token per peer, all of a peer's datagrams staged together even when interleaved */
+            const auto sg = md->StagedRead();
+            vector<ConToken> opened, closed;
+            md->TakeConEvents(&opened, &closed);
+            Assert::IsTrue(opened.size() == 2 && sg.r->size() == 2 && (*sg.r)[0].in.size() == 2);
+
+            auto ps = make_shared<PipeSet>();
+            ps->MergeConEvents(opened, closed);
+            ps->RemakeForRead(*sg.r);
+            Assert::IsTrue(ps->QueueDepth() == 3 && ps->QueueDepth(opened[0]) == 2);
+
+            md->Send(opened[0], Buf("x\n"));
+            Assert::IsTrue(md->Flush() == 1);
+            Sleep(100);
+
+            char rb[16];
+            u_long blockmode = 1;
+            ioctlsocket(ca, FIONBIO, &blockmode);
+            Assert::IsTrue(recv(ca, rb, sizeof rb, 0) == 2 && !memcmp(rb, "x\n", 2));
+
+            md->ReclaimIdle(0);
+            md->TakeConEvents(&opened, &closed);
+            Assert::IsTrue(closed.size() == 2 && md->GetConTokens().empty());
+
+            closesocket(ca);
+            closesocket(cb);
+        };
+
+        TEST_METHOD(HotRestartResume) {
+            auto pu = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec::Unix("NetStuffTest.sock")));
+            PollFdType wc = GNetNat.ConnectUnix("NetStuffTest.sock");
+            Sleep(100);
+            vector<PollFdType> acc;
+            Assert::IsTrue(pu->AcceptBatch(&acc, 8) == 1);
+
+            HandoffChannel oldCh(acc[0]), newCh(wc);
+            vector<HandoffChannel::Handoff_t> none;
+            Sleep(100);
+            oldCh.Recv(&none);
+            newCh.Recv(&none);
+
+            /* Old process: one parsed packet not yet popped, half of the next one buffered */
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27017")));
+            SOCKET cl = ConnectLocal("27017");
+            Sleep(100);
+            auto m1 = make_shared<MessSock>();
+            m1->AcceptedConsMulti(pl->Accept());
+            auto ps1 = make_shared<PipeSet>();
+            ps1->MergePacketed(m1->GetConTokens());
+
+            send(cl, "x\nha", 4, 0);
+            Sleep(100);
+            ps1->RemakeForRead(*m1->StagedRead().r);
+            Assert::IsTrue(ps1->QueueDepth() == 1);
+
+            const ConToken tok = m1->GetConTokens()[0];
+
+            /* A channel that cannot send (peer unknown yet) leaves the connection where it was */
+            {
+                PollFdType lc = GNetNat.ConnectUnix("NetStuffTest.sock");
+                Sleep(100);
+                acc.clear();
+                Assert::IsTrue(pu->AcceptBatch(&acc, 8) == 1);
+                HandoffChannel lonely(acc[0]);
+                bool threw = false;
+                try { HotRestart::Export(m1.get(), ps1.get(), &lonely); } catch (exception &) { threw = true; }
+                Assert::IsTrue(threw && m1->GetConTokens().size() == 1 && ps1->QueueDepth(tok) == 1);
+                closesocket(lc.s);
+            }
+
+            Assert::IsTrue(HotRestart::Export(m1.get(), ps1.get(), &oldCh) == 1);
+            Assert::IsTrue(m1->GetConTokens().empty() && ps1->pipes.empty());
+
+            /* New process picks up mid-packet */
+            Sleep(100);
+            auto m2 = make_shared<MessSock>();
+            auto ps2 = make_shared<PipeSet>();
+            Assert::IsTrue(HotRestart::Import(m2.get(), ps2.get(), &newCh) == 1);
+            Assert::IsTrue(m2->GetConTokens().size() == 1 && m2->GetConTokens()[0].id == tok.id && ps2->QueueDepth() == 1);
+
+            send(cl, "lf\n", 3, 0);
+            Sleep(100);
+            ps2->RemakeForRead(*m2->StagedRead().r);
+
+            vector<PipeSet::Popped_t> out;
+            Assert::IsTrue(ps2->PopPackets(&out, 8) == 2 && out[0].data == "x\n" && out[1].data == "half\n");
+
+            Sleep(100);
+            oldCh.Recv(&none);
+            closesocket(cl);
+        };
+
+        TEST_METHOD(HashRingRemap) {
+            HashRing ring;
+            for (uint32_t w = 0; w < 3; w++) ring.Add(w);
+
+            vector<uint32_t> before(1000), after(1000);
+            for (uint32_t k = 0; k < 1000; k++) ring.Lookup(HashRing::Hash((const char *)&k, sizeof k), &before[k]);
+
+            /* A new worker only takes keys, roughly its share */
+            ring.Add(3);
+            size_t moved = 0;
+            for (uint32_t k = 0; k < 1000; k++) {
+                ring.Lookup(HashRing::Hash((const char *)&k, sizeof k), &after[k]);
+                if (after[k] != before[k]) { Assert::IsTrue(after[k] == 3); moved++; }
+            }
+            Assert::IsTrue(moved > 100 && moved < 400);
+
+            /* Removing it again restores the old mapping exactly */
+            ring.Remove(3);
+            for (uint32_t k = 0; k < 1000; k++) {
+                ring.Lookup(HashRing::Hash((const char *)&k, sizeof k), &after[k]);
+                Assert::IsTrue(after[k] == before[k]);
+            }
+        };
+
+        TEST_METHOD(ClusterRoute) {
+            auto a = PrimitiveShm::Create("NetStuffTestShmA", 4096), aw = PrimitiveShm::Open("NetStuffTestShmA");
+            auto b = PrimitiveShm::Create("NetStuffTestShmB", 4096), bw = PrimitiveShm::Open("NetStuffTestShmB");
+
+            ClusterFront front;
+            front.AddWorker(0, shared_ptr<HandoffChannel>(), a);
+            front.AddWorker(1, shared_ptr<HandoffChannel>(), b);
+
+            vector<PipeSet::Popped_t> pk;
+            for (size_t i = 0; i < 20; i++) {
+                Buf d(1, (char)('a' + i % 10));
+                d += " x\n";
+                pk.push_back(PipeSet::Popped_t(ConToken(0), move(d)));
+            }
+
+            Assert::IsTrue(front.Route(&pk) == 20 && pk.empty() && front.Flush() == 0);
+
+            /* Both packets of a key land on the same worker */
+            string got[2];
+            deque<Fragment> w;
+            try { aw->ReadU(&w); } catch (NetBlockExc &e) {}
+            for (auto &i : w) got[0].append(i.data.data(), i.data.size());
+            w.clear();
+            try { bw->ReadU(&w); } catch (NetBlockExc &e) {}
+            for (auto &i : w) got[1].append(i.data.data(), i.data.size());
+
+            Assert::IsTrue(got[0].size() + got[1].size() == 20 * 4);
+            for (char c = 'a'; c < 'a' + 10; c++) {
+                const string line = string(1, c) + " x\n";
+                const bool inA = got[0].find(line) != string::npos, inB = got[1].find(line) != string::npos;
+                Assert::IsTrue(inA != inB);
+            }
+        };
+
+        TEST_METHOD(RelayPair) {
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27018")));
+            auto pb = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27019")));
+
+            SOCKET cl = ConnectLocal("27018");
+            SOCKET up = ConnectLocal("27019");
+            Sleep(100);
+            vector<PollFdType> bs = pb->Accept();
+            Assert::IsTrue(bs.size() == 1);
+
+            u_long blockmode = 1;
+            ioctlsocket(up, FIONBIO, &blockmode);
+            ioctlsocket(cl, FIONBIO, &blockmode);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(pl->Accept());
+            m->AcceptedConsMulti(vector<PollFdType>(1, GNetNat.MakePollFdType(up)));
+            const vector<ConToken> toks = m->GetConTokens();
+
+            /* Routing decision on a peeked header, nothing consumed */
+            send(cl, "GET x\n", 6, 0);
+            Sleep(100);
+            char hdr[3];
+            Assert::IsTrue(m->Peek(toks[0], hdr, 3) == 3 && !memcmp(hdr, "GET", 3));
+            m->Pair(toks[0], toks[1]);
+
+            /* Both directions, enough to back up the upstream side a few times */
+            const string chunk(64 * 1024, 'r');
+            size_t sent = 0, got = 0;
+            char rb[64 * 1024];
+            for (size_t i = 0; i < 2000 && got < 4 * 1024 * 1024 + 6; i++) {
+                if (sent < 4 * 1024 * 1024) {
+                    int r = send(cl, chunk.data(), (int)min(chunk.size(), 4 * 1024 * 1024 - sent), 0);
+                    if (r > 0) sent += r;
+                }
+                Assert::IsTrue(m->StagedRead().r->empty());
+                if (i % 3 == 0) continue;
+                int r = recv(bs[0].s, rb, sizeof rb, 0);
+                if (r > 0) got += r;
+            }
+            Assert::IsTrue(got == 4 * 1024 * 1024 + 6);
+
+            send(bs[0].s, "resp", 4, 0);
+            Sleep(100);
+            m->StagedRead();
+            Sleep(100);
+            Assert::IsTrue(recv(cl, rb, sizeof rb, 0) == 4 && !memcmp(rb, "resp", 4));
+
+            /* Half-close travels through, the pair closes once both sides are done */
+            shutdown(cl, SD_SEND);
+            Sleep(100);
+            Assert::IsTrue(m->StagedRead().d->empty());
+            Sleep(100);
+            Assert::IsTrue(recv(bs[0].s, rb, sizeof rb, 0) == 0);
+            closesocket(bs[0].s);
+            Sleep(100);
+            Assert::IsTrue(m->StagedRead().d->size() == 2);
+
+            m->RemoveKnownClosed();
+            Assert::IsTrue(m->GetConTokens().empty());
+            closesocket(cl);
+        };
+
+        TEST_METHOD(BroadcastShared) {
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27020")));
+            SOCKET cls[3];
+            for (auto &i : cls) i = ConnectLocal("27020");
+            Sleep(100);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(pl->Accept());
+            Assert::IsTrue(m->GetConTokens().size() == 3);
+
+            /* One copy, referenced from each connection's queue until sent */
+            SharedBuf sb = make_shared<Buf>(256 * 1024, 'b');
+            Assert::IsTrue(m->Broadcast(m->GetConTokens(), sb) == 3 && sb.use_count() == 4);
+            Assert::IsTrue(m->Send(m->GetConTokens()[0], Buf("tail")));
+
+            u_long blockmode = 1;
+            for (auto &i : cls) ioctlsocket(i, FIONBIO, &blockmode);
+
+            size_t got[3] = { 0, 0, 0 };
+            char rb[64 * 1024];
+            for (size_t k = 0; k < 1000 && (got[0] < 256 * 1024 + 4 || got[1] < 256 * 1024 || got[2] < 256 * 1024); k++) {
+                m->StagedWrite();
+                for (size_t i = 0; i < 3; i++) {
+                    int r = recv(cls[i], rb, sizeof rb, 0);
+                    if (r > 0) got[i] += r;
+                }
+            }
+
+            Assert::IsTrue(got[0] == 256 * 1024 + 4 && got[1] == 256 * 1024 && got[2] == 256 * 1024);
+            Assert::IsTrue(m->StagedWrite() == 0 && sb.use_count() == 1);
+
+            for (auto &i : cls) closesocket(i);
+        };
+
+        TEST_METHOD(TopicPubSub) {
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27021")));
+            SOCKET cls[3];
+            for (auto &i : cls) i = ConnectLocal("27021");
+            Sleep(100);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(pl->Accept());
+            auto ps = make_shared<PipeSet>();
+            ps->MergePacketed(m->GetConTokens());
+
+            TopicRouter tr;
+            vector<PipeSet::Popped_t> pk;
+            auto pump = [&]() {
+                Sleep(100);
+                ps->RemakeForRead(*m->StagedRead().r);
+                ps->PopPackets(&pk, 64);
+                tr.Route(m.get(), &pk);
+                m->StagedWrite();
+                Sleep(100);
+            };
+
+            send(cls[0], "+news\n", 6, 0);
+            send(cls[1], "+news\n+sport\n", 13, 0);
+            send(cls[2], "+sport\n", 7, 0);
+            pump();
+            Assert::IsTrue(tr.Subscribers("news") == 2 && tr.Subscribers("sport") == 2);
+
+            u_long blockmode = 1;
+            for (auto &i : cls) ioctlsocket(i, FIONBIO, &blockmode);
+
+            char rb[256];
+            send(cls[2], "news hello\n", 11, 0);
+            pump();
+            Assert::IsTrue(recv(cls[0], rb, sizeof rb, 0) == 11 && !memcmp(rb, "news hello\n", 11));
+            Assert::IsTrue(recv(cls[1], rb, sizeof rb, 0) == 11);
+            Assert::IsTrue(recv(cls[2], rb, sizeof rb, 0) == SOCKET_ERROR);
+
+            send(cls[1], "-news\n", 6, 0);
+            pump();
+            send(cls[2], "news again\n", 11, 0);
+            pump();
+            Assert::IsTrue(recv(cls[0], rb, sizeof rb, 0) == 11 && recv(cls[1], rb, sizeof rb, 0) == SOCKET_ERROR);
+
+            /* Publishing to, or asking about, a topic nobody is on leaves the router as it was */
+            send(cls[2], "nobody here\n", 12, 0);
+            pump();
+            Assert::IsTrue(tr.Subscribers("ghost") == 0 && tr.Topics() == 2);
+
+            tr.Drop(m->GetConTokens());
+            Assert::IsTrue(tr.Subscribers("news") == 0 && tr.Subscribers("sport") == 0 && tr.Topics() == 0);
+
+            for (auto &i : cls) closesocket(i);
+        };
+
+        TEST_METHOD(RpcPipelined) {
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27022")));
+            SOCKET up = ConnectLocal("27022");
+            Sleep(100);
+
+            u_long blockmode = 1;
+            ioctlsocket(up, FIONBIO, &blockmode);
+
+            auto ms = make_shared<MessSock>(), mc = make_shared<MessSock>();
+            ms->AcceptedConsMulti(pl->Accept());
+            mc->AcceptedConsMulti(vector<PollFdType>(1, GNetNat.MakePollFdType(up)));
+
+            PipeSet pss, psc;
+            pss.packStream.lenPrefix = psc.packStream.lenPrefix = true;
+            pss.MergePacketed(ms->GetConTokens());
+            psc.MergePacketed(mc->GetConTokens());
+
+            RpcEndpoint srv, cli;
+            vector<PipeSet::Popped_t> pk;
+            vector<RpcEndpoint::Request_t> reqs;
+            vector<RpcEndpoint::Completion_t> done;
+            auto pump = [&](MessSock *m, PipeSet *ps, RpcEndpoint *e) {
+                Sleep(100);
+                ps->RemakeForRead(*m->StagedRead().r);
+                ps->PopPackets(&pk, 64);
+                e->Dispatch(&pk, &reqs, &done);
+            };
+
+            /* Three calls on one connection, binary bodies, the server answers them backwards */
+            const ConToken tc = mc->GetConTokens()[0];
+            uint32_t ids[3];
+            ids[0] = cli.Call(mc.get(), tc, "a\n\0", 3, 0);
+            ids[1] = cli.Call(mc.get(), tc, "bb", 2, 0);
+            ids[2] = cli.Call(mc.get(), tc, "ccc", 3, 0);
+            mc->StagedWrite();
+            Assert::IsTrue(cli.InFlight() == 3);
+
+            pump(ms.get(), &pss, &srv);
+            Assert::IsTrue(reqs.size() == 3 && reqs[0].body == Buf("a\n\0", 3));
+            for (size_t i = reqs.size(); i--; ) {
+                const Buf r = "re:" + reqs[i].body;
+                srv.Reply(ms.get(), reqs[i].tok, reqs[i].id, r.data(), r.size());
+            }
+            reqs.clear();
+            ms->StagedWrite();
+
+            pump(mc.get(), &psc, &cli);
+            Assert::IsTrue(done.size() == 3 && cli.InFlight() == 0);
+            Assert::IsTrue(done[0].id == ids[2] && done[0].body == "re:ccc" && done[0].status == RpcEndpoint::Status::Ok);
+            Assert::IsTrue(done[2].id == ids[0] && done[2].body == Buf("re:a\n\0", 6));
+            done.clear();
+
+            /* Deadline passes before the reply, the late reply is ignored */
+            const uint32_t late = cli.Call(mc.get(), tc, "x", 1, 10);
+            mc->StagedWrite();
+            Assert::IsTrue(cli.Expire(9, &done) == 0 && cli.Expire(10, &done) == 1);
+            Assert::IsTrue(done[0].id == late && done[0].status == RpcEndpoint::Status::Timeout);
+            done.clear();
+
+            pump(ms.get(), &pss, &srv);
+            Assert::IsTrue(reqs.size() == 1);
+            srv.Reply(ms.get(), reqs[0].tok, reqs[0].id, "y", 1);
+            ms->StagedWrite();
+            const uint32_t reused = cli.Call(mc.get(), tc, "z", 1, 0);
+            Assert::IsTrue(reused != late);
+            pump(mc.get(), &psc, &cli);
+            Assert::IsTrue(done.empty() && cli.InFlight() == 1);
+
+            Assert::IsTrue(cli.Drop(mc->GetConTokens(), &done) == 1 && done[0].status == RpcEndpoint::Status::Closed);
+
+            /* A call the connection refuses gives its slot back */
+            bool refused = false;
+            try { cli.Call(mc.get(), ConToken(77), "w", 1, 0); } catch (exception &) { refused = true; }
+            Assert::IsTrue(refused && cli.InFlight() == 0);
+        };
+
+        TEST_METHOD(StreamMuxFair) {
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27023")));
+            SOCKET up = ConnectLocal("27023");
+            Sleep(100);
+
+            u_long blockmode = 1;
+            ioctlsocket(up, FIONBIO, &blockmode);
+
+            auto ms = make_shared<MessSock>(), mc = make_shared<MessSock>();
+            ms->AcceptedConsMulti(pl->Accept());
+            mc->AcceptedConsMulti(vector<PollFdType>(1, GNetNat.MakePollFdType(up)));
+
+            PipeSet pss;
+            pss.packStream.lenPrefix = true;
+            pss.MergePacketed(ms->GetConTokens());
+
+            StreamMux srv, cli;
+            srv.window = cli.window = 64 * 1024;
+            const ConToken tc = mc->GetConTokens()[0];
+
+            vector<PipeSet::Popped_t> pk;
+            vector<StreamMux::Data_t> got;
+            size_t bulk = 0, ctl = 0;
+            auto pump = [&]() {
+                for (size_t i = 0; i < 10; i++) {
+                    cli.Schedule(mc.get());
+                    mc->StagedWrite();
+                }
+                Sleep(100);
+                pss.RemakeForRead(*ms->StagedRead().r);
+                pss.PopPackets(&pk, 1024);
+                srv.Dispatch(&pk, &got);
+            };
+
+            /* Control written after a bulk backlog still goes out right behind the first bulk frame */
+            const string big(1024 * 1024, 'b');
+            cli.Write(tc, 1, big.data(), big.size());
+            cli.Write(tc, 2, "ping", 4);
+            pump();
+            Assert::IsTrue(got.size() >= 2 && got[0].stream == 1 && got[1].stream == 2 && got[1].data == "ping");
+
+            /* Bulk stalls at its window until the receiver consumes */
+            for (auto &i : got) (i.stream == 1 ? bulk : ctl) += i.data.size();
+            got.clear();
+            Assert::IsTrue(bulk == 64 * 1024 && ctl == 4);
+            Assert::IsTrue(cli.Pending(tc, 1) == big.size() - bulk);
+
+            srv.Consumed(ms->GetConTokens()[0], 1, bulk);
+            srv.Schedule(ms.get());
+            ms->StagedWrite();
+            Sleep(100);
+
+            PipeSet psc;
+            psc.packStream.lenPrefix = true;
+            psc.MergePacketed(mc->GetConTokens());
+            psc.RemakeForRead(*mc->StagedRead().r);
+            psc.PopPackets(&pk, 64);
+            cli.Dispatch(&pk, &got);
+            Assert::IsTrue(got.empty());
+
+            pump();
+            for (auto &i : got) bulk += i.data.size();
+            Assert::IsTrue(bulk == 128 * 1024);
+            got.clear();
+
+            /* Peer-opened streams are capped, a closed one frees its place */
+            srv.maxStreams = 3;
+            cli.Write(tc, 3, "s3", 2);
+            cli.Write(tc, 4, "s4", 2);
+            pump();
+            Assert::IsTrue(got.size() == 1 && got[0].stream == 3);
+            got.clear();
+
+            cli.Close(tc, 2);
+            cli.Write(tc, 5, "s5", 2);
+            pump();
+            Assert::IsTrue(got.size() == 1 && got[0].stream == 2 && got[0].data.empty());
+            got.clear();
+
+            cli.Write(tc, 5, "s5", 2);
+            pump();
+            Assert::IsTrue(got.size() == 1 && got[0].stream == 5 && cli.Pending(tc, 2) == 0);
+
+            /* Frames refused by the socket drop the streams instead of counting as sent */
+            const ConToken gone(77);
+            cli.Write(gone, 1, big.data(), big.size());
+            cli.Schedule(mc.get());
+            Assert::IsTrue(cli.Pending(gone, 1) == 0 && cli.Pending(tc, 5) == 0);
+        };
+
+        TEST_METHOD(MsgTypedDispatch) {
+            const MsgDispatch<MsgCounter, MsgList<MsgPing, MsgSay, MsgMove>::Type> md;
+            Assert::IsTrue(MsgDispatch<MsgCounter, MsgList<MsgPing, MsgSay, MsgMove>::Type>::Size == 5);
+
+            /* As a length-prefixed pipe delivers them: the 4 byte frame header stripped */
+            vector<PipeSet::Popped_t> pk;
+            auto put = [&](const Buf &frame) { pk.push_back(PipeSet::Popped_t(ConToken(0), Buf(frame, 4))); };
+
+            Buf b;
+            MsgPing p; p.seq = 7;
+            MsgPut(&b, p); put(b); b.clear();
+            p.seq = 5;
+            MsgPut(&b, p); put(b); b.clear();
+            MsgMove mv; mv.x = 3; mv.y = -2;
+            MsgPut(&b, mv); put(b); b.clear();
+            MsgHeader(&b, MsgSay::Id, 5); b += "hello"; put(b); b.clear();
+            MsgHeader(&b, 3, 1); b += "?"; put(b); b.clear();
+            MsgHeader(&b, 9, 0); put(b); b.clear();
+            MsgHeader(&b, MsgPing::Id, 1); b += "!"; put(b); b.clear();
+
+            MsgCounter c;
+            Assert::IsTrue(md.Dispatch(&c, &pk) == 4 && pk.empty());
+            Assert::IsTrue(c.pings == 2 && c.seqSum == 12 && c.xy == -6 && c.said == "hello");
+        };
+
+        TEST_METHOD(FlatInPlace) {
+            const string blob(100 * 1024, 'z');
+
+            Buf b;
+            FlatBuilder fb(&b, 4);
+            fb.PutBytes(0, "name", 4);
+            fb.PutU64(1, 0x0102030405060708ull);
+            fb.PutBytes(2, blob.data(), blob.size());
+            fb.PutU32(3, 42);
+            fb.Finish();
+
+            /* What a length-prefixed pipe delivers, and a copy shifted off any alignment */
+            const Buf msg(b, 4);
+            Buf odd(" ");
+            odd += msg;
+
+            FlatView v(msg), w(odd.data() + 1, msg.size());
+            const FlatType types[] = { FlatType::Bytes, FlatType::U64, FlatType::Bytes, FlatType::U32 };
+            const FlatSchema sc(vector<FlatType>(types, types + 4));
+            Assert::IsTrue(sc.Check(v) && sc.Check(w));
+
+            const char *d;
+            size_t l;
+            Assert::IsTrue(w.U32(3, 0) == 42 && w.U64(1, 0) == 0x0102030405060708ull);
+            Assert::IsTrue(w.Bytes(0, &d, &l) && l == 4 && !memcmp(d, "name", 4));
+            Assert::IsTrue(v.Bytes(2, &d, &l) && l == blob.size() && d >= msg.data() && d < msg.data() + msg.size());
+            Assert::IsTrue(!v.Has(7) && v.U32(7, 9) == 9);
+
+            /* Cut short: the blob no longer fits, everything before it still reads */
+            FlatView t(msg.data(), msg.size() - 1);
+            Assert::IsTrue(!sc.Check(t) && t.U64(1, 0) == 0x0102030405060708ull);
+
+            uint32_t bogus = 0xffffff00;
+            Buf bad(msg);
+            memcpy(&bad[4 + 3 * 4], &bogus, 4);
+            Assert::IsTrue(!sc.Check(FlatView(bad)) && FlatView(bad).U32(3, 1) == 1);
+        };
+
+        TEST_METHOD(CrcTrailers) {
+            /* Standard check value */
+            Assert::IsTrue(Crc32c::Update(0, "123456789", 9) == 0xe3069283);
+            Assert::IsTrue(Crc32c::Update(Crc32c::Update(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27024")));
+            SOCKET cl = ConnectLocal("27024");
+            Sleep(100);
+
+            auto m = make_shared<MessSock>();
+            m->AcceptedConsMulti(pl->Accept());
+            PipeSet ps;
+            ps.packStream.lenPrefix = ps.packStream.crc = true;
+            ps.MergePacketed(m->GetConTokens());
+
+            Buf b;
+            const string big(3000, 'q');
+            PackLenEx::Frame(&b, "first", 5, true);
+            const size_t corrupt = b.size();
+            PackLenEx::Frame(&b, "second", 6, true);
+            b[corrupt + 6] ^= 1;
+            PackLenEx::Frame(&b, big.data(), big.size(), true);
+
+            /* Split inside the last frame so its checksum spans two reads */
+            vector<PipeSet::Popped_t> pk;
+            const size_t half = b.size() - 1000;
+            send(cl, b.data(), (int)half, 0);
+            Sleep(100);
+            ps.RemakeForRead(*m->StagedRead().r);
+            send(cl, b.data() + half, (int)(b.size() - half), 0);
+            Sleep(100);
+            ps.RemakeForRead(*m->StagedRead().r);
+
+            ps.PopPackets(&pk, 64);
+            Assert::IsTrue(pk.size() == 2 && pk[0].data == "first" && pk[1].data.size() == big.size());
+
+            vector<ConToken> bad;
+            Assert::IsTrue(ps.TakeBadPackets(&bad) == 1 && bad[0].id == m->GetConTokens()[0].id);
+            Assert::IsTrue(ps.TakeBadPackets(&bad) == 0);
+
+            closesocket(cl);
+        };
+
+        TEST_METHOD(CompressBlocks) {
+            /* Codec round trips, including matches reaching into the dictionary and overlapping copies */
+            const string dict = "GET /api/v1/items?id= HTTP/1.1 Host: example.com Accept: */*";
+            const string text = "GET /api/v1/items?id=42 HTTP/1.1 Host: example.com Accept: */* aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa end";
+            Buf z, back;
+            Assert::IsTrue(CompressStage::Compress(text.data(), text.size(), dict.data(), dict.size(), &z) && z.size() < text.size() / 2);
+            Assert::IsTrue(CompressStage::Decompress(z.data(), z.size(), dict.data(), dict.size(), text.size(), &back) && back == text.c_str());
+            Assert::IsTrue(!CompressStage::Decompress(z.data(), z.size(), dict.data(), dict.size(), text.size() + 1, &back));
+            Assert::IsTrue(!CompressStage::Decompress(z.data(), z.size() - 3, dict.data(), dict.size(), text.size(), &back));
+
+            auto pl = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27025")));
+            SOCKET up = ConnectLocal("27025");
+            Sleep(100);
+
+            u_long blockmode = 1;
+            ioctlsocket(up, FIONBIO, &blockmode);
+
+            auto ms = make_shared<MessSock>(), mc = make_shared<MessSock>();
+            ms->AcceptedConsMulti(pl->Accept());
+            mc->AcceptedConsMulti(vector<PollFdType>(1, GNetNat.MakePollFdType(up)));
+            const ConToken ts = ms->GetConTokens()[0], tc = mc->GetConTokens()[0];
+
+            CompressStage srv, cli;
+            srv.SetDictionary(dict.data(), dict.size(), 7);
+            cli.SetDictionary(dict.data(), dict.size(), 7);
+            srv.Enable(ms.get(), ts);
+            cli.Enable(mc.get(), tc);
+            ms->StagedWrite();
+            mc->StagedWrite();
+            Sleep(100);
+
+            PipeSet ps;
+            ps.MergePacketed(ms->GetConTokens());
+            vector<MessSock::StagedRead_t> rs = *mc->StagedRead().r;
+            cli.Inflate(&rs);
+            Assert::IsTrue(cli.PeerHelloP(tc) && rs[0].in.empty());
+
+            /* Small, compressible, then random (stored) */
+            string rnd;
+            uint32_t x = 1;
+            for (size_t i = 0; i < 4000; i++) { x = x * 1103515245 + 12345; rnd += (char)('!' + (x >> 16) % 90); }
+            const string pkts[] = { "hi\n", text + "\n", string(20000, 'x') + "\n", rnd + "\n" };
+            for (auto &i : pkts) cli.Send(mc.get(), tc, i.data(), i.size());
+            mc->StagedWrite();
+            Sleep(100);
+
+            rs = *ms->StagedRead().r;
+            srv.Inflate(&rs);
+            ps.RemakeForRead(rs);
+
+            vector<PipeSet::Popped_t> pk;
+            ps.PopPackets(&pk, 64);
+            Assert::IsTrue(pk.size() == 4);
+            for (size_t i = 0; i < 4; i++) Assert::IsTrue(pk[i].data == pkts[i].c_str());
+            Assert::IsTrue(cli.Saved() > 19000 && cli.Saved() < 21000);
+
+            /* A block that fails to decode is reported, the connection's later input is dropped */
+            const char junk[] = { 'L', 0, 0, 0, 5, 0, 0, 0, 9, 1 };
+            send(up, junk, sizeof junk, 0);
+            cli.Send(mc.get(), tc, "ok\n", 3);
+            mc->StagedWrite();
+            Sleep(100);
+
+            vector<ConToken> bad;
+            rs = *ms->StagedRead().r;
+            srv.Inflate(&rs);
+            Assert::IsTrue(rs[0].in.empty() && srv.TakeBadBlocks(&bad) == 1 && bad[0].id == ts.id);
+            Assert::IsTrue(srv.TakeBadBlocks(&bad) == 0);
+        };
+
+        TEST_METHOD(StageChainFused) {
+            auto pa = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27026")));
+            auto pb = make_shared<PrimitiveListening>(vector<ListenSpec>(1, ListenSpec("27027")));
+            SOCKET ca = ConnectLocal("27026"), cb = ConnectLocal("27027");
+            Sleep(100);
+
+            /* Listener a: inflate, then two stateless stages fused into one pass. Listener b: plain. */
+            auto m = make_shared<MessSock>();
+            auto cs = make_shared<CompressStage>();
+            char k1 = 0x20, k2 = 0x01;
+            auto chain = make_shared<StageChain>();
+            chain->Add(make_shared<StageInflate>(cs));
+            chain->Add(make_shared<StageSpan>(&XorSpan, &k1));
+            chain->Add(make_shared<StageSpan>(&XorSpan, &k2));
+            Assert::IsTrue(chain->Stages() == 2);
+
+            PipeSet ps;
+            const vector<ConToken> ta = m->AcceptedConsMulti(pa->Accept());
+            m->AcceptedConsMulti(pb->Accept());
+            ps.MergePacketed(m->GetConTokens());
+            ps.SetChain(ta, chain);
+            cs->Enable(m.get(), ta[0]);
+
+            /* Hello and a stored block by hand, the payload masked with k1 ^ k2 */
+            string body = "hello\n";
+            for (auto &c : body) c ^= 0x21;
+            Buf blk;
+            const uint32_t hello = 0, len = htonl((uint32_t)body.size());
+            blk += 'H'; blk.append("\0\0\0\4", 4); blk.append((const char *)&hello, 4);
+            blk += 'S'; blk.append((const char *)&len, 4); blk.append(body.data(), body.size());
+            send(ca, blk.data(), (int)blk.size(), 0);
+            send(cb, "plain\n", 6, 0);
+            Sleep(100);
+
+            vector<MessSock::StagedRead_t> rs = *m->StagedRead().r;
+            ps.RemakeForRead(&rs);
+
+            vector<PipeSet::Popped_t> pk;
+            ps.PopPackets(&pk, 64);
+            Assert::IsTrue(pk.size() == 2);
+            for (auto &i : pk) Assert::IsTrue(i.tok.id == ta[0].id ? i.data == "hello\n" : i.data == "plain\n");
+
+            closesocket(ca);
+            closesocket(cb);
+        };
+
     };
-}
\ No newline at end of file
+}